@@ -0,0 +1,166 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+#include <zlib.h>
+
+#include "Image.h"
+#include "Utility.h"
+
+// State of an interrupted synthesis, stored as a header and a zlib body in
+// native byte order
+struct Checkpoint {
+    static constexpr uint32_t MAGIC = 0x504B4351; // "QCKP"
+    static constexpr uint32_t VERSION = 1;
+
+    int patch {};
+    int overlap {};
+    int pass {};
+    double alpha {};
+    uint64_t seed {};
+
+    multivec<char> done;
+    multivec<Coordinate> offsets;
+    multivec<Coordinate> previous_offsets;
+    int previous_chunk {};
+
+    Image quilt;
+
+    // Writes to a temporary file first and renames it over path, so a job
+    // killed while saving keeps the checkpoint before
+    void save(std::string const& path) const
+    {
+        auto body = std::vector<u_char> {};
+
+        auto const put = [&body](auto value) {
+            auto const bytes = reinterpret_cast<u_char const*>(&value);
+            body.insert(body.end(), bytes, bytes + sizeof(value));
+        };
+
+        auto const put_grid = [&put](auto const& grid) {
+            put(static_cast<uint32_t>(grid.width()));
+            put(static_cast<uint32_t>(grid.height()));
+
+            for (auto y = 0; y < grid.height(); y++)
+                for (auto x = 0; x < grid.width(); x++)
+                    put(grid[x, y]);
+        };
+
+        put(patch);
+        put(overlap);
+        put(pass);
+        put(alpha);
+        put(seed);
+        put(previous_chunk);
+        put_grid(done);
+        put_grid(offsets);
+        put_grid(previous_offsets);
+
+        put(static_cast<uint32_t>(quilt.width()));
+        put(static_cast<uint32_t>(quilt.height()));
+
+        for (auto y = 0; y < quilt.height(); y++)
+            for (auto x = 0; x < quilt.width(); x++)
+                put(quilt[x, y].value);
+
+        auto compressed = std::vector<u_char>(compressBound(body.size()));
+        auto compressed_size = static_cast<uLongf>(compressed.size());
+
+        if (compress2(compressed.data(), &compressed_size, body.data(), body.size(), Z_BEST_SPEED) != Z_OK)
+            throw std::runtime_error("Cannot compress checkpoint '" + path + "'.");
+
+        auto const header = std::array<uint64_t, 3> { MAGIC, VERSION, body.size() };
+        auto const temporary = path + ".tmp";
+        auto file = std::unique_ptr<FILE, int (*)(FILE*)>(fopen(temporary.c_str(), "wb"), fclose);
+
+        if (!file)
+            throw std::runtime_error("Cannot write checkpoint '" + temporary + "'.");
+
+        fwrite(header.data(), sizeof(uint64_t), header.size(), file.get());
+        fwrite(compressed.data(), 1, compressed_size, file.get());
+
+        // On disk before the rename, or a crash may leave an empty checkpoint
+        if (fflush(file.get()) || ferror(file.get()) || fsync(fileno(file.get())) || fclose(file.release()))
+            throw std::runtime_error("Cannot write checkpoint '" + temporary + "'.");
+
+        std::filesystem::rename(temporary, path);
+    }
+
+    static Checkpoint load(std::string const& path)
+    {
+        auto file = std::ifstream(path, std::ios::binary);
+        auto contents = std::vector<u_char>(std::istreambuf_iterator<char>(file), {});
+        auto header = std::array<uint64_t, 3> {};
+
+        if (contents.size() < sizeof(header))
+            throw std::runtime_error("Cannot read checkpoint '" + path + "'.");
+
+        memcpy(header.data(), contents.data(), sizeof(header));
+
+        if (header[0] != MAGIC || header[1] != VERSION)
+            throw std::runtime_error("'" + path + "' is not a checkpoint of this version.");
+
+        auto body = std::vector<u_char>(header[2]);
+        auto body_size = static_cast<uLongf>(body.size());
+
+        if (uncompress(body.data(), &body_size, contents.data() + sizeof(header), contents.size() - sizeof(header)) != Z_OK || body_size != body.size())
+            throw std::runtime_error("Checkpoint '" + path + "' is corrupt.");
+
+        auto const* cursor = body.data();
+        auto const* const end = body.data() + body.size();
+
+        auto const get = [&]<typename T>(T& value) {
+            if (end - cursor < sizeof(T))
+                throw std::runtime_error("Checkpoint '" + path + "' is truncated.");
+
+            memcpy(&value, cursor, sizeof(T));
+            cursor += sizeof(T);
+        };
+
+        auto const get_grid = [&get]<typename T>(multivec<T>& grid) {
+            auto width = uint32_t {}, height = uint32_t {};
+            get(width);
+            get(height);
+
+            grid = multivec<T>(width, height, T {});
+
+            for (auto y = 0; y < height; y++)
+                for (auto x = 0; x < width; x++)
+                    get(grid[x, y]);
+        };
+
+        auto checkpoint = Checkpoint {};
+
+        get(checkpoint.patch);
+        get(checkpoint.overlap);
+        get(checkpoint.pass);
+        get(checkpoint.alpha);
+        get(checkpoint.seed);
+        get(checkpoint.previous_chunk);
+        get_grid(checkpoint.done);
+        get_grid(checkpoint.offsets);
+        get_grid(checkpoint.previous_offsets);
+
+        auto width = uint32_t {}, height = uint32_t {};
+        get(width);
+        get(height);
+
+        checkpoint.quilt = Image(width, height);
+
+        for (auto y = 0; y < height; y++)
+            for (auto x = 0; x < width; x++)
+                get(checkpoint.quilt[x, y].value);
+
+        return checkpoint;
+    }
+};
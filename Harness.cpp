@@ -0,0 +1,506 @@
+#include <chrono>
+#include <cmath>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <optional>
+#include <random>
+#include <sstream>
+
+#include "Quilt.h"
+#include "Transfer.h"
+
+#include <getopt.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// Speed and quality of one seeded job. The quality figures are errors, so
+// lower is better on every column but candidates.
+struct Result {
+    double wall;
+    double rss;
+    double candidates;
+    double overlap;
+    double seam;
+    double constraint;
+};
+
+struct Job {
+    std::string name;
+    int texture;
+    int patch;
+    int overlap;
+    int matching { Quilt::MATCH_RGBA };
+    int stride { 1 };
+
+    // Passes of a transfer onto the harness constraint, 0 for a quilt
+    int depth {};
+
+    // Views of the texture a quilt searches, see Quilt::set_views()
+    int views { Quilt::VIEWS_ORIGINAL };
+};
+
+// Size of every generated texture, and of the quilts made from them
+static constexpr int TEXTURE_SIZE = 128;
+static constexpr int QUILT_SIZE = 160;
+static constexpr int CONSTRAINT_SIZE = 96;
+
+// Smooth value noise of a few octaves in [0, 1), the same on every run
+static Plane value_noise(int size, uint32_t seed)
+{
+    auto generator = std::mt19937(seed);
+    auto noise = std::vector<double>(size * size);
+
+    for (auto cell = 32; cell >= 4; cell /= 2) {
+        auto const lattice = size / cell + 2;
+        auto values = std::vector<double>(lattice * lattice);
+
+        for (auto& value : values)
+            value = std::uniform_real_distribution<>(0, 1)(generator);
+
+        for (auto y = 0; y < size; y++)
+            for (auto x = 0; x < size; x++) {
+                auto const fx = x / static_cast<double>(cell), fy = y / static_cast<double>(cell);
+                auto const ix = static_cast<int>(fx), iy = static_cast<int>(fy);
+                auto const tx = fx - ix, ty = fy - iy;
+                auto const at = [&](int i, int j) { return values[j * lattice + i]; };
+
+                auto const top = at(ix, iy) * (1 - tx) + at(ix + 1, iy) * tx;
+                auto const bottom = at(ix, iy + 1) * (1 - tx) + at(ix + 1, iy + 1) * tx;
+
+                noise[y * size + x] += (top * (1 - ty) + bottom * ty) * cell / 60.;
+            }
+    }
+
+    auto plane = Plane(size, size, 0);
+
+    for (auto y = 0; y < size; y++)
+        for (auto x = 0; x < size; x++)
+            plane[x, y] = static_cast<u_char>(std::clamp(noise[y * size + x], 0., 1.) * 255);
+
+    return plane;
+}
+
+static RGBA pixel(double r, double g, double b)
+{
+    auto const channel = [](double value) { return static_cast<png_byte>(std::clamp(value, 0., 255.)); };
+
+    return RGBA { channel(r), channel(g), channel(b), 255 };
+}
+
+// The generated corpus: soft blobs, bricks and wood grain, which stress
+// the matchers with smooth gradients, sharp regular edges and long
+// anisotropic features
+static std::vector<std::pair<std::string, Image>> generate_corpus()
+{
+    auto corpus = std::vector<std::pair<std::string, Image>> {};
+    auto const n = TEXTURE_SIZE;
+
+    auto blobs = Image(n, n);
+    auto const hue = value_noise(n, 1), shade = value_noise(n, 2);
+
+    for (auto y = 0; y < n; y++)
+        for (auto x = 0; x < n; x++)
+            blobs[x, y] = pixel(hue[x, y] * 1.2, shade[x, y], 255 - hue[x, y]);
+
+    corpus.emplace_back("blobs", std::move(blobs));
+
+    auto bricks = Image(n, n);
+    auto const grit = value_noise(n, 3);
+
+    for (auto y = 0; y < n; y++)
+        for (auto x = 0; x < n; x++) {
+            auto const course = y / 16;
+            auto const mortar = y % 16 < 2 || (x + (course % 2) * 16) % 32 < 2;
+            auto const g = grit[x, y] - 128.;
+
+            bricks[x, y] = mortar ? pixel(200 + g / 4, 195 + g / 4, 185 + g / 4) : pixel(150 + g / 2 + course * 3, 60 + g / 3, 45 + g / 3);
+        }
+
+    corpus.emplace_back("bricks", std::move(bricks));
+
+    auto wood = Image(n, n);
+    auto const warp = value_noise(n, 4);
+
+    for (auto y = 0; y < n; y++)
+        for (auto x = 0; x < n; x++) {
+            auto const grain = std::sin(x * 0.35 + warp[x, y] * 0.08) * 0.5 + 0.5;
+
+            wood[x, y] = pixel(120 + grain * 80, 75 + grain * 50, 40 + grain * 20);
+        }
+
+    corpus.emplace_back("wood", std::move(wood));
+
+    return corpus;
+}
+
+// Target of the transfer jobs: a radial gradient crossed by a dark bar
+static Image generate_constraint()
+{
+    auto constraint = Image(CONSTRAINT_SIZE, CONSTRAINT_SIZE);
+    auto const centre = CONSTRAINT_SIZE / 2.;
+
+    for (auto y = 0; y < CONSTRAINT_SIZE; y++)
+        for (auto x = 0; x < CONSTRAINT_SIZE; x++) {
+            auto const distance = std::hypot(x - centre, y - centre) / centre;
+            auto const bar = std::abs(x - y) < 8;
+            auto const value = bar ? 30. : 255 * (1 - std::min(distance, 1.));
+
+            constraint[x, y] = pixel(value, value, value);
+        }
+
+    return constraint;
+}
+
+// Mean squared RGB error per pixel between a transfer and its constraint
+static double constraint_error(Image const& output, Image const& constraint)
+{
+    auto error = 0.;
+
+    for (auto y = 0; y < constraint.height(); y++)
+        for (auto x = 0; x < constraint.width(); x++) {
+            auto const a = output[x, y].ch, b = constraint[x, y].ch;
+            auto const square = [](int difference) { return static_cast<double>(difference * difference); };
+
+            error += square(a.r - b.r) + square(a.g - b.g) + square(a.b - b.b);
+        }
+
+    return error / (static_cast<double>(constraint.width()) * constraint.height());
+}
+
+// Runs job in this process and measures everything but the memory
+static Result run_job(Job const& job, Image const& texture, Image const& constraint, unsigned threads)
+{
+    auto const configure = [&](Quilt& quilt) {
+        quilt.set_seed(1);
+        quilt.set_threads(threads);
+        quilt.set_matching(job.matching);
+        quilt.set_subsampling(job.stride, 8);
+    };
+
+    auto const measure = [](Quilt const& quilt, auto start) {
+        auto const wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        auto const scanning = quilt.scan_time();
+
+        return Result {
+            .wall = wall,
+            .candidates = scanning > 0 ? quilt.scanned_candidates() / scanning : 0.,
+            .overlap = quilt.mean_overlap_error(),
+            .seam = static_cast<double>(quilt.seam_energy()),
+        };
+    };
+
+    auto const start = std::chrono::steady_clock::now();
+
+    if (!job.depth) {
+        auto quilt = Quilt(texture, QUILT_SIZE, QUILT_SIZE);
+        configure(quilt);
+        quilt.set_views(job.views);
+
+        quilt.synthesize(job.patch, job.overlap, 3);
+
+        return measure(quilt, start);
+    }
+
+    auto transfer = Transfer(texture, constraint);
+    transfer.set_correspondence(job.matching);
+    configure(transfer);
+
+    transfer.synthesize(job.patch, job.depth, 3);
+
+    auto result = measure(transfer, start);
+    result.constraint = constraint_error(transfer.snapshot(), constraint);
+
+    return result;
+}
+
+// Runs job in a child process, so that its peak resident set is its own
+static Result run_isolated(Job const& job, Image const& texture, Image const& constraint, unsigned threads)
+{
+    int channel[2];
+
+    if (pipe(channel))
+        throw std::runtime_error("Cannot create a pipe for job " + job.name + ".");
+
+    std::cout.flush();
+
+    auto const pid = fork();
+
+    if (pid < 0)
+        throw std::runtime_error("Cannot fork job " + job.name + ".");
+
+    if (!pid) {
+        close(channel[0]);
+
+        try {
+            auto const result = run_job(job, texture, constraint, threads);
+            auto const written = write(channel[1], &result, sizeof(result));
+
+            _exit(written == sizeof(result) ? 0 : 1);
+        } catch (std::exception const& error) {
+            std::cerr << "[Harness] " << job.name << ": " << error.what() << '\n';
+            _exit(1);
+        }
+    }
+
+    close(channel[1]);
+
+    auto result = Result {};
+    auto const received = read(channel[0], &result, sizeof(result));
+    close(channel[0]);
+
+    auto status = 0;
+    auto usage = rusage {};
+    wait4(pid, &status, 0, &usage);
+
+    if (received != sizeof(result) || !WIFEXITED(status) || WEXITSTATUS(status))
+        throw std::runtime_error("Job " + job.name + " failed.");
+
+    result.rss = usage.ru_maxrss / 1024.;
+
+    return result;
+}
+
+// Relative change tolerated before a metric counts as better or worse
+struct Tolerances {
+    double time { 0.1 };
+    double memory { 0.1 };
+    double quality { 0.01 };
+};
+
+// Baseline checked when -B is not given, recorded on the generated corpus
+static constexpr auto DEFAULT_BASELINE = "harness-baseline.txt";
+
+// Reads results saved by save_results(), and into tolerances those they were
+// recorded under
+static std::map<std::string, Result> load_results(std::string const& path, Tolerances& tolerances)
+{
+    auto file = std::ifstream(path);
+
+    if (!file)
+        throw std::runtime_error("Cannot read baseline '" + path + "'.");
+
+    auto results = std::map<std::string, Result> {};
+    auto line = std::string {};
+
+    while (std::getline(file, line)) {
+        if (line.starts_with("# tolerances"))
+            std::istringstream(line.substr(12)) >> tolerances.time >> tolerances.memory >> tolerances.quality;
+
+        if (line.empty() || line.front() == '#')
+            continue;
+
+        auto stream = std::istringstream(line);
+        auto name = std::string {};
+        auto result = Result {};
+
+        if (stream >> name >> result.wall >> result.rss >> result.candidates >> result.overlap >> result.seam >> result.constraint)
+            results[name] = result;
+    }
+
+    return results;
+}
+
+static void save_results(std::string const& path, std::vector<Job> const& jobs, std::vector<Result> const& results, Tolerances const& tolerances)
+{
+    auto file = std::ofstream(path);
+
+    if (!file)
+        throw std::runtime_error("Cannot write results '" + path + "'.");
+
+    file << "# tolerances " << tolerances.time << ' ' << tolerances.memory << ' ' << tolerances.quality << '\n';
+    file << "# job wall-seconds peak-rss-mib candidates-per-second mean-overlap-ssd seam-energy constraint-mse\n";
+    file.precision(9);
+
+    for (auto i = 0; i < jobs.size(); i++)
+        file << jobs[i].name << ' ' << results[i].wall << ' ' << results[i].rss << ' ' << results[i].candidates << ' '
+             << results[i].overlap << ' ' << results[i].seam << ' ' << results[i].constraint << '\n';
+}
+
+int main(int argc, char** argv)
+{
+    auto texture_paths = std::vector<std::string> {};
+    auto baseline_path = std::string {};
+    auto save_path = std::string {};
+    auto filter = std::string {};
+    auto threads = 1u;
+    auto repeats = 3;
+
+    // Tolerances given on the command line, which override the baseline's
+    auto time_tolerance = std::optional<double> {};
+    auto memory_tolerance = std::optional<double> {};
+    auto quality_tolerance = std::optional<double> {};
+
+    option longopts[] = {
+        option { "texture", 1, NULL, 't' },
+        option { "baseline", 1, NULL, 'B' },
+        option { "save", 1, NULL, 'S' },
+        option { "filter", 1, NULL, 'f' },
+        option { "threads", 1, NULL, 'j' },
+        option { "repeat", 1, NULL, 'r' },
+        option { "time-tolerance", 1, NULL, 'T' },
+        option { "memory-tolerance", 1, NULL, 'M' },
+        option { "quality-tolerance", 1, NULL, 'Q' },
+        NULL
+    };
+
+    auto option = '\0';
+
+    while ((option = getopt_long(argc, argv, "t:B:S:f:j:r:T:M:Q:", longopts, 0)) != -1) {
+        switch (option) {
+        case 't':
+            texture_paths.push_back(optarg);
+            break;
+        case 'B':
+            baseline_path = { optarg };
+            break;
+        case 'S':
+            save_path = { optarg };
+            break;
+        case 'f':
+            filter = { optarg };
+            break;
+        case 'j':
+            threads = std::max(atoi(optarg), 1);
+            break;
+        case 'r':
+            repeats = std::max(atoi(optarg), 1);
+            break;
+        case 'T':
+            time_tolerance = atof(optarg);
+            break;
+        case 'M':
+            memory_tolerance = atof(optarg);
+            break;
+        case 'Q':
+            quality_tolerance = atof(optarg);
+            break;
+        }
+    }
+
+    if (baseline_path.empty() && std::filesystem::exists(DEFAULT_BASELINE))
+        baseline_path = DEFAULT_BASELINE;
+
+    // Read before any job runs, so that -S may overwrite it
+    auto tolerances = Tolerances {};
+    auto const baseline = baseline_path.empty() ? std::map<std::string, Result> {} : load_results(baseline_path, tolerances);
+
+    tolerances = { time_tolerance.value_or(tolerances.time), memory_tolerance.value_or(tolerances.memory), quality_tolerance.value_or(tolerances.quality) };
+
+    // Generated textures first, then any given with -t
+    auto corpus = generate_corpus();
+
+    for (auto const& path : texture_paths)
+        corpus.emplace_back(std::filesystem::path(path).stem().string(), Image(path));
+
+    auto const constraint = generate_constraint();
+
+    // Every texture runs the specialized and generic kernels, both matchers,
+    // a subsampled scan, a scan of every view and a two-pass transfer
+    auto jobs = std::vector<Job> {};
+
+    for (auto i = 0; i < corpus.size(); i++) {
+        auto const& name = corpus[i].first;
+
+        jobs.push_back({ name + "/quilt-rgba-18-3", i, 18, 3 });
+        jobs.push_back({ name + "/quilt-luminance-18-3", i, 18, 3, Quilt::MATCH_LUMINANCE });
+        jobs.push_back({ name + "/quilt-stride2-18-3", i, 18, 3, Quilt::MATCH_RGBA, 2 });
+        jobs.push_back({ name + "/quilt-rgba-20-5", i, 20, 5 });
+        jobs.push_back({ name + "/quilt-views-18-3", i, 18, 3, Quilt::MATCH_RGBA, 1, 0, Quilt::VIEWS_ALL });
+        jobs.push_back({ name + "/transfer-rgba-18-d2", i, 18, 3, Quilt::MATCH_RGBA, 1, 2 });
+    }
+
+    std::erase_if(jobs, [&filter](Job const& job) { return job.name.find(filter) == std::string::npos; });
+
+    // Seeded jobs make the same image every time, so the repeats only
+    // steady the wall time, which is the best of them
+    auto results = std::vector<Result> {};
+
+    for (auto const& job : jobs) {
+        auto best = Result {};
+
+        for (auto repeat = 0; repeat < repeats; repeat++) {
+            auto const result = run_isolated(job, corpus[job.texture].second, constraint, threads);
+
+            if (!repeat || result.wall < best.wall)
+                best = { result.wall, std::max(best.rss, result.rss), result.candidates, result.overlap, result.seam, result.constraint };
+            else
+                best.rss = std::max(best.rss, result.rss);
+        }
+
+        results.push_back(best);
+
+        std::cout << "[Harness] " << std::left << std::setw(32) << job.name << std::right << std::fixed
+                  << std::setprecision(3) << std::setw(8) << best.wall << "s "
+                  << std::setprecision(1) << std::setw(7) << best.rss << "MiB "
+                  << std::setprecision(0) << std::setw(11) << best.candidates << " cand/s  overlap "
+                  << std::setprecision(2) << best.overlap << "  seam " << std::setprecision(0) << best.seam;
+
+        if (job.depth)
+            std::cout << "  constraint " << std::setprecision(2) << best.constraint;
+
+        std::cout << '\n';
+    }
+
+    if (!save_path.empty())
+        save_results(save_path, jobs, results, tolerances);
+
+    if (baseline_path.empty())
+        return 0;
+
+    // Judges every job on speed and memory against quality. A job only
+    // regresses if it got worse on one side without getting better on the
+    // other; trading one for the other is reported but allowed.
+    auto regressions = 0;
+    auto tradeoffs = 0;
+
+    auto const change = [](double now, double then) { return then > 0 ? now / then - 1 : 0.; };
+
+    for (auto i = 0; i < jobs.size(); i++) {
+        auto const it = baseline.find(jobs[i].name);
+
+        if (it == baseline.end()) {
+            std::cout << "[Harness] " << jobs[i].name << ": not in the baseline\n";
+            continue;
+        }
+
+        auto const& now = results[i];
+        auto const& then = it->second;
+
+        auto const time = change(now.wall, then.wall);
+        auto const memory = change(now.rss, then.rss);
+        // Worst and best change over the quality metrics
+        auto const quality = std::max({ change(now.overlap, then.overlap), change(now.seam, then.seam), change(now.constraint, then.constraint) });
+        auto const quality_gain = std::min({ change(now.overlap, then.overlap), change(now.seam, then.seam), change(now.constraint, then.constraint) });
+
+        auto const slower = time > tolerances.time || memory > tolerances.memory;
+        auto const faster = time < -tolerances.time || memory < -tolerances.memory;
+        auto const worse = quality > tolerances.quality;
+        auto const better = quality_gain < -tolerances.quality;
+
+        auto verdict = "same";
+
+        if ((slower && !better) || (worse && !faster)) {
+            verdict = "REGRESSION";
+            regressions++;
+        } else if (slower || worse) {
+            verdict = "trade-off";
+            tradeoffs++;
+        } else if (faster || better) {
+            verdict = "improved";
+        }
+
+        std::cout << "[Harness] " << std::left << std::setw(32) << jobs[i].name << std::right << std::showpos << std::fixed
+                  << std::setprecision(1) << " time " << std::setw(6) << time * 100 << "%"
+                  << " rss " << std::setw(6) << memory * 100 << "%"
+                  << " quality " << std::setw(6) << (quality > 0 ? quality : quality_gain) * 100 << "%" << std::noshowpos
+                  << "  " << verdict << '\n';
+    }
+
+    std::cout << "[Harness] " << regressions << " regressions, " << tradeoffs << " trade-offs against " << baseline_path << '\n';
+
+    return regressions ? 1 : 0;
+}
@@ -1,16 +1,78 @@
 #pragma once
 
+#include <algorithm>
 #include <array>
+#include <atomic>
 #include <cassert>
+#include <cctype>
+#include <condition_variable>
+#include <cstring>
+#include <endian.h>
+#include <exception>
 #include <fstream>
+#include <functional>
+#include <limits>
 #include <memory>
+#include <mutex>
+#include <stdexcept>
 #include <string>
+#include <string_view>
+#include <thread>
 #include <vector>
 
 #include <png.h>
+#include <zlib.h>
 
+#include "Topology.h"
 #include "Utility.h"
 
+// Pixel order of images and their planes. Build with -DIMAGE_TILE=8 or 16 to
+// store them as square tiles instead of rows.
+#ifdef IMAGE_TILE
+using ImageLayout = TiledLayout<IMAGE_TILE>;
+#else
+using ImageLayout = RowMajorLayout;
+#endif
+
+using Plane = multivec<u_char, ImageLayout>;
+
+// Row-length template argument for kernels fed by for_each_span(). Fixed
+// lengths only apply when whole rows are contiguous.
+template <int N>
+constexpr int span_length = ImageLayout::contiguous ? N : 0;
+
+// Calls function(first_pixel, second_pixel, offset, length) for the runs of
+// the n-pixel rows at a in first and at b in second that are contiguous in
+// both. With row-major storage this is a single call.
+template <typename First, typename Second, typename Function>
+[[gnu::always_inline]] inline void for_each_span(First& first, Coordinate a, Second& second, Coordinate b, int n, Function&& function)
+{
+    for (auto offset = 0; offset < n;) {
+        auto const length = std::min(first.run(a.x + offset, n - offset), second.run(b.x + offset, n - offset));
+
+        function(&first[a + Coordinate { offset, 0 }], &second[b + Coordinate { offset, 0 }], offset, length);
+
+        offset += length;
+    }
+}
+
+// Settings of the PNG encoder in Image::write
+struct PNGOptions {
+    static constexpr int FILTER_NONE = 0;
+    static constexpr int FILTER_SUB = 1;
+    static constexpr int FILTER_UP = 2;
+    static constexpr int FILTER_AVERAGE = 3;
+    static constexpr int FILTER_PAETH = 4;
+    // Picks the best of the above for every row
+    static constexpr int FILTER_ADAPTIVE = 5;
+
+    int level { Z_DEFAULT_COMPRESSION };
+    int filter { FILTER_ADAPTIVE };
+
+    // Number of stripes compressed in parallel, 0 for one per core
+    int stripes {};
+};
+
 class Image {
 private:
     std::string m_filename {};
@@ -20,7 +82,7 @@ private:
     png_byte m_color_type {};
     png_byte m_bit_depth {};
 
-    multivec<RGBA> m_image;
+    multivec<RGBA, ImageLayout> m_image;
 
 public:
     Image() {};
@@ -32,7 +94,7 @@ public:
         m_color_type = PNG_COLOR_TYPE_RGBA;
         m_bit_depth = 8;
 
-        m_image = decltype(m_image)(m_height, m_width, 0);
+        m_image = decltype(m_image)(m_width, m_height, 0);
     }
 
     Image(std::string const& filename)
@@ -46,7 +108,7 @@ public:
         assert(y >= 0 && y < m_height);
         assert(x >= 0 && x < m_width);
 
-        return m_image[x + y * m_width];
+        return m_image[x, y];
     }
 
     RGBA& operator[](Coordinate const& coord)
@@ -59,7 +121,7 @@ public:
         assert(y >= 0 && y < m_height);
         assert(x >= 0 && x < m_width);
 
-        return m_image[x + y * m_width];
+        return m_image[x, y];
     }
 
     RGBA const& operator[](Coordinate const& coord) const
@@ -70,6 +132,25 @@ public:
     int height() const { return m_height; }
     int width() const { return m_width; }
 
+    int run(int x, int n) const { return m_image.run(x, n); }
+
+    // 8-bit Rec. 601 luma of every pixel, for bandwidth-bound matchers
+    Plane luminance() const
+    {
+        auto plane = Plane(m_width, m_height, 0);
+
+        // Planes share the image layout, so storage indices line up
+        for (auto i = 0; i < m_image.size(); i++)
+            plane[i] = luminance(m_image[i]);
+
+        return plane;
+    }
+
+    static u_char luminance(RGBA const& pixel)
+    {
+        return (77 * pixel.ch.r + 150 * pixel.ch.g + 29 * pixel.ch.b) >> 8;
+    }
+
     void open()
     {
         assert(m_filename.size());
@@ -77,11 +158,149 @@ public:
         open(m_filename);
     }
 
-    void open(std::string const& filename)
+    // Called with the number of rows decoded so far, first with 0 once the
+    // image has its size and then as rows arrive, so that they can be used
+    // before the rest is decoded
+    using RowsDecoded = std::function<void(int)>;
+
+    // Reads a PNG, PPM/PGM/PAM, QOI or raw image, told apart by their magic
+    // bytes. "-", optionally behind a format prefix, reads standard input.
+    void open(std::string const& filename, RowsDecoded const& decoded = {})
+    {
+        auto const file = open_file(filename, "rb");
+
+        auto magic = std::array<char, 4> {};
+        auto const magic_is = [&magic](std::string_view expected) {
+            return std::string_view(magic.data(), expected.size()) == expected;
+        };
+
+        if (fread(magic.data(), 1, 2, file.get()) != 2)
+            throw std::runtime_error("Cannot read image '" + filename + "'.");
+
+        if (magic_is("\x89P")) {
+            open_png(file.get(), decoded);
+        } else if (magic_is("P5") || magic_is("P6") || magic_is("P7")) {
+            open_pnm(file.get(), magic[1], decoded);
+        } else if (fread(magic.data() + 2, 1, 2, file.get()) == 2 && magic_is("qoif")) {
+            open_qoi(file.get(), decoded);
+        } else if (magic_is("RGBA")) {
+            open_raw(file.get(), decoded);
+        } else {
+            throw std::runtime_error("Unknown image format in '" + filename + "'.");
+        }
+    }
+
+    // Width and height of an image file from its header alone, without
+    // decoding any pixels. Streams cannot be read twice, so they have none.
+    static Coordinate size_of(std::string const& filename)
+    {
+        assert(!is_stream(filename));
+
+        auto const file = open_file(filename, "rb");
+
+        auto header = std::array<u_char, 24> {};
+
+        if (fread(header.data(), 1, 2, file.get()) != 2)
+            throw std::runtime_error("Cannot read image '" + filename + "'.");
+
+        auto const read = [&](size_t n) {
+            if (fread(header.data() + 2, 1, n, file.get()) != n)
+                throw std::runtime_error("Truncated header in image '" + filename + "'.");
+        };
+
+        if (header[0] == 0x89 && header[1] == 'P') {
+            // The rest of the signature, then IHDR, which comes first
+            read(22);
+            return { static_cast<int>(read_big_endian(&header[16])), static_cast<int>(read_big_endian(&header[20])) };
+        } else if (header[0] == 'P' && header[1] >= '5' && header[1] <= '7') {
+            auto const pnm = pnm_header(file.get(), header[1]);
+            return { pnm.width, pnm.height };
+        } else if (header[0] == 'q' && header[1] == 'o') {
+            read(10);
+            return { static_cast<int>(read_big_endian(&header[4])), static_cast<int>(read_big_endian(&header[8])) };
+        } else if (header[0] == 'R' && header[1] == 'G') {
+            read(10);
+
+            auto size = std::array<uint32_t, 2> {};
+            memcpy(size.data(), &header[4], sizeof(size));
+
+            return { static_cast<int>(le32toh(size[0])), static_cast<int>(le32toh(size[1])) };
+        }
+
+        throw std::runtime_error("Unknown image format in '" + filename + "'.");
+    }
+
+    // File or standard stream named by filename, closed when it goes out of
+    // scope unless it is a standard stream
+    using File = std::unique_ptr<FILE, int (*)(FILE*)>;
+
+    static File open_file(std::string const& filename, char const* mode)
+    {
+        if (is_stream(filename))
+            return File(*mode == 'r' ? stdin : stdout, [](FILE*) { return 0; });
+
+        auto file = File(fopen(path_of(filename).c_str(), mode), fclose);
+
+        if (!file)
+            throw std::runtime_error(std::string(*mode == 'r' ? "Cannot open" : "Cannot write") + " image '" + filename + "'.");
+
+        return file;
+    }
+
+    // Whether filename, as in "-" or "pam:-", stands for stdin or stdout
+    static bool is_stream(std::string const& filename)
+    {
+        return filename == "-" || filename.ends_with(":-");
+    }
+
+    static constexpr int FORMAT_PNG = 0;
+    static constexpr int FORMAT_PPM = 1;
+    static constexpr int FORMAT_PAM = 2;
+    static constexpr int FORMAT_QOI = 3;
+    static constexpr int FORMAT_RAW = 4;
+
+    // Output format from a "png:", "ppm:", "pam:", "qoi:" or "raw:" prefix or
+    // from the extension. Streams default to PAM, the cheapest to produce
+    // that keeps alpha; files default to PNG.
+    static int format_of(std::string const& filename)
+    {
+        if (auto const prefix = format_prefix(filename); prefix >= 0)
+            return prefix;
+
+        if (auto const dot = filename.rfind('.'); dot != std::string::npos)
+            if (auto const extension = format_name(filename.substr(dot + 1)); extension >= 0)
+                return extension;
+
+        return is_stream(filename) ? FORMAT_PAM : FORMAT_PNG;
+    }
+
+    // Filename without its format prefix, if any
+    static std::string path_of(std::string const& filename)
     {
-        auto file = fopen(filename.c_str(), "rb");
-        assert(file);
+        return format_prefix(filename) >= 0 ? filename.substr(filename.find(':') + 1) : filename;
+    }
 
+private:
+    static int format_name(std::string name)
+    {
+        static constexpr std::array names = { "png", "ppm", "pam", "qoi", "raw" };
+
+        std::transform(name.begin(), name.end(), name.begin(), [](u_char c) { return std::tolower(c); });
+
+        auto const it = std::find(names.begin(), names.end(), name);
+        return it == names.end() ? -1 : static_cast<int>(it - names.begin());
+    }
+
+    static int format_prefix(std::string const& filename)
+    {
+        auto const colon = filename.find(':');
+        return colon == std::string::npos ? -1 : format_name(filename.substr(0, colon));
+    }
+
+    // The two signature bytes have been read already. Interlaced images are
+    // only complete after the last pass, so their rows arrive all at once.
+    void open_png(FILE* file, RowsDecoded const& decoded)
+    {
         auto png = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
         assert(png);
 
@@ -92,6 +311,7 @@ public:
             abort();
 
         png_init_io(png, file);
+        png_set_sig_bytes(png, 2);
         png_read_info(png, info);
 
         m_width = png_get_image_width(png, info);
@@ -117,40 +337,285 @@ public:
         if (m_color_type == PNG_COLOR_TYPE_GRAY || m_color_type == PNG_COLOR_TYPE_GRAY_ALPHA)
             png_set_gray_to_rgb(png);
 
+        auto const interlaced = png_set_interlace_handling(png) > 1;
+
         png_read_update_info(png, info);
 
-        auto rows = (png_bytep*)malloc(sizeof(png_bytep) * m_height);
+        m_image = decltype(m_image)(m_width, m_height, 0);
 
-        for (auto i = 0; i < m_height; i++)
-            rows[i] = (png_byte*)malloc(png_get_rowbytes(png, info));
+        if (decoded)
+            decoded(0);
 
-        png_read_image(png, rows);
+        auto const row_bytes = png_get_rowbytes(png, info);
+        auto pixels = std::vector<png_byte>(row_bytes * (interlaced ? m_height : 1));
 
-        fclose(file);
+        auto const store = [&](png_byte const* row, int y) {
+            for (auto x = 0; x < m_width; x++) {
+                auto const* const color = &row[x * 4];
+                auto& pixel = m_image[x, y];
+
+                pixel.ch.r = color[0];
+                pixel.ch.g = color[1];
+                pixel.ch.b = color[2];
+                pixel.ch.a = color[3];
+            }
+        };
+
+        if (interlaced) {
+            auto rows = std::vector<png_bytep>(m_height);
+
+            for (auto y = 0; y < m_height; y++)
+                rows[y] = pixels.data() + y * row_bytes;
+
+            png_read_image(png, rows.data());
+
+            for (auto y = 0; y < m_height; y++)
+                store(rows[y], y);
+
+            if (decoded)
+                decoded(m_height);
+        } else {
+            for (auto y = 0; y < m_height; y++) {
+                png_read_row(png, pixels.data(), NULL);
+                store(pixels.data(), y);
+
+                if (decoded)
+                    decoded(y + 1);
+            }
+        }
 
         png_destroy_read_struct(&png, &info, NULL);
+    }
 
-        m_image = decltype(m_image)(m_height, m_width, 0);
+    // Next whitespace-separated word of a PNM header, skipping comments. The
+    // single whitespace byte after the word is consumed too, so after the
+    // last header word the file is at the pixel data.
+    static std::string pnm_word(FILE* file)
+    {
+        auto word = std::string {};
+        auto c = getc(file);
 
-        for (auto i = 0; i < m_height; i++) {
-            auto row = rows[i];
+        while (c != EOF && (std::isspace(c) || c == '#')) {
+            if (c == '#')
+                while (c != EOF && c != '\n')
+                    c = getc(file);
 
-            for (auto j = 0; j < m_width; j++) {
-                auto const* const color = &(row[j * 4]);
-                auto& pixel = m_image[j + i * m_width];
+            c = getc(file);
+        }
 
-                pixel.ch.r = color[0];
-                pixel.ch.g = color[1];
-                pixel.ch.b = color[2];
-                pixel.ch.a = color[3];
+        for (; c != EOF && !std::isspace(c); c = getc(file))
+            word += static_cast<char>(c);
+
+        return word;
+    }
+
+    struct PNMHeader {
+        int width {};
+        int height {};
+        int depth {};
+        int maxval { 255 };
+    };
+
+    // Header of a PGM (P5), PPM (P6) or PAM (P7) whose magic has been read,
+    // leaving the file at the pixel data
+    static PNMHeader pnm_header(FILE* file, char type)
+    {
+        auto header = PNMHeader { .depth = type == '5' ? 1 : 3 };
+
+        if (type == '7') {
+            for (auto key = pnm_word(file); key != "ENDHDR"; key = pnm_word(file)) {
+                if (key.empty())
+                    throw std::runtime_error("Truncated PAM header.");
+
+                auto const value = pnm_word(file);
+
+                if (key == "WIDTH")
+                    header.width = std::stoi(value);
+                else if (key == "HEIGHT")
+                    header.height = std::stoi(value);
+                else if (key == "DEPTH")
+                    header.depth = std::stoi(value);
+                else if (key == "MAXVAL")
+                    header.maxval = std::stoi(value);
             }
+        } else {
+            header.width = std::stoi(pnm_word(file));
+            header.height = std::stoi(pnm_word(file));
+            header.maxval = std::stoi(pnm_word(file));
+        }
+
+        return header;
+    }
+
+    // Binary PGM (P5), PPM (P6) or PAM (P7) with 8-bit samples. The magic
+    // has been read already.
+    void open_pnm(FILE* file, char type, RowsDecoded const& decoded)
+    {
+        auto const [width, height, depth, maxval] = pnm_header(file, type);
+
+        if (maxval != 255 || depth < 1 || depth > 4)
+            throw std::runtime_error("Only 8-bit PNM images with 1 to 4 channels are supported.");
+
+        m_width = width;
+        m_height = height;
+
+        m_color_type = PNG_COLOR_TYPE_RGBA;
+        m_bit_depth = 8;
+        m_image = decltype(m_image)(m_width, m_height, 0);
 
-            free(row);
+        if (decoded)
+            decoded(0);
+
+        auto row = std::vector<u_char>(static_cast<size_t>(m_width) * depth);
+
+        for (auto y = 0; y < m_height; y++) {
+            if (fread(row.data(), 1, row.size(), file) != row.size())
+                throw std::runtime_error("Truncated PNM image.");
+
+            for (auto x = 0; x < m_width; x++) {
+                auto const* const sample = &row[x * depth];
+                auto& pixel = m_image[x, y];
+
+                // Gray and gray-alpha tuples replicate the gray sample
+                auto const gray = depth < 3;
+
+                pixel.ch.r = sample[0];
+                pixel.ch.g = sample[gray ? 0 : 1];
+                pixel.ch.b = sample[gray ? 0 : 2];
+                pixel.ch.a = depth == 2 || depth == 4 ? sample[depth - 1] : 255;
+            }
+
+            if (decoded)
+                decoded(y + 1);
+        }
+    }
+
+    static uint32_t read_big_endian(u_char const* bytes)
+    {
+        return bytes[0] << 24 | bytes[1] << 16 | bytes[2] << 8 | bytes[3];
+    }
+
+    static int qoi_hash(RGBA pixel)
+    {
+        return (pixel.ch.r * 3 + pixel.ch.g * 5 + pixel.ch.b * 7 + pixel.ch.a * 11) % 64;
+    }
+
+    // QOI, see https://qoiformat.org/qoi-specification.pdf. The magic has
+    // been read already.
+    void open_qoi(FILE* file, RowsDecoded const& decoded)
+    {
+        auto header = std::array<u_char, 10> {};
+
+        if (fread(header.data(), 1, header.size(), file) != header.size())
+            throw std::runtime_error("Truncated QOI header.");
+
+        m_width = read_big_endian(&header[0]);
+        m_height = read_big_endian(&header[4]);
+        m_color_type = PNG_COLOR_TYPE_RGBA;
+        m_bit_depth = 8;
+        m_image = decltype(m_image)(m_width, m_height, 0);
+
+        if (decoded)
+            decoded(0);
+
+        auto index = std::array<RGBA, 64> {};
+        index.fill(RGBA { 0u });
+
+        auto pixel = RGBA { 0x000000FFu };
+        auto run = 0;
+
+        auto const next = [file] {
+            auto const c = getc(file);
+
+            if (c == EOF)
+                throw std::runtime_error("Truncated QOI image.");
+
+            return static_cast<u_char>(c);
+        };
+
+        for (auto y = 0; y < m_height; y++) {
+            for (auto x = 0; x < m_width; x++) {
+                if (run > 0) {
+                    run--;
+                } else {
+                    auto const tag = next();
+
+                    if (tag == 0xFE) {
+                        pixel.ch.r = next();
+                        pixel.ch.g = next();
+                        pixel.ch.b = next();
+                    } else if (tag == 0xFF) {
+                        pixel.ch.r = next();
+                        pixel.ch.g = next();
+                        pixel.ch.b = next();
+                        pixel.ch.a = next();
+                    } else if ((tag & 0xC0) == 0x00) {
+                        pixel = index[tag];
+                    } else if ((tag & 0xC0) == 0x40) {
+                        pixel.ch.r += ((tag >> 4) & 3) - 2;
+                        pixel.ch.g += ((tag >> 2) & 3) - 2;
+                        pixel.ch.b += (tag & 3) - 2;
+                    } else if ((tag & 0xC0) == 0x80) {
+                        auto const second = next();
+                        auto const dg = (tag & 0x3F) - 32;
+
+                        pixel.ch.r += dg - 8 + ((second >> 4) & 0xF);
+                        pixel.ch.g += dg;
+                        pixel.ch.b += dg - 8 + (second & 0xF);
+                    } else {
+                        run = tag & 0x3F;
+                    }
+
+                    index[qoi_hash(pixel)] = pixel;
+                }
+
+                m_image[x, y] = pixel;
+            }
+
+            if (decoded)
+                decoded(y + 1);
         }
 
-        free(rows);
+        // Skip the end marker so that a stream can hold several images
+        for (auto i = 0; i < 8; i++)
+            next();
+    }
+
+    // Raw format: "RGBA", then width and height as little-endian 32-bit
+    // integers, then the pixels row by row. The magic has been read already.
+    void open_raw(FILE* file, RowsDecoded const& decoded)
+    {
+        auto header = std::array<uint32_t, 2> {};
+
+        if (fread(header.data(), sizeof(uint32_t), 2, file) != 2)
+            throw std::runtime_error("Truncated raw image header.");
+
+        m_width = le32toh(header[0]);
+        m_height = le32toh(header[1]);
+        m_color_type = PNG_COLOR_TYPE_RGBA;
+        m_bit_depth = 8;
+        m_image = decltype(m_image)(m_width, m_height, 0);
+
+        if (decoded)
+            decoded(0);
+
+        // Rows go straight into the image storage
+        for (auto y = 0; y < m_height; y++) {
+            for (auto x = 0; x < m_width;) {
+                auto const n = m_image.run(x, m_width - x);
+
+                if (fread(&m_image[x, y], sizeof(RGBA), n, file) != n)
+                    throw std::runtime_error("Truncated raw image.");
+
+                x += n;
+            }
+
+            if (decoded)
+                decoded(y + 1);
+        }
     }
 
+public:
     void write(bool alpha = true) const
     {
         assert(m_filename.size());
@@ -158,61 +623,490 @@ public:
         write(m_filename, alpha);
     }
 
-    void write(std::string const& filename, bool alpha = true) const
+private:
+    // Encodes rows [first, last) as filtered PNG scanlines into a raw deflate
+    // stream in out, and their Adler-32 into adler. Stripes other than the
+    // last end on a full flush, which byte-aligns them and resets the
+    // dictionary, so independently compressed stripes can be concatenated.
+    void deflate_stripe(int first, int last, bool alpha, PNGOptions const& options, std::vector<u_char>& out, uLong& adler) const
     {
-        auto file = fopen(filename.c_str(), "wb");
-        assert(file);
+        auto const bpp = alpha ? 4 : 3;
+        auto const row_bytes = static_cast<size_t>(m_width) * bpp;
+        auto const scanline = row_bytes + 1;
 
-        auto png = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
-        assert(png);
+        auto stream = z_stream {};
+        auto const strategy = options.filter == PNGOptions::FILTER_NONE ? Z_DEFAULT_STRATEGY : Z_FILTERED;
+        auto status = deflateInit2(&stream, options.level, Z_DEFLATED, -15, 8, strategy);
+        assert(status == Z_OK);
 
-        auto info = png_create_info_struct(png);
-        assert(info);
+        // A full flush adds an empty stored block of at most 5 bytes
+        out.resize(deflateBound(&stream, scanline * (last - first)) + 16);
+        stream.next_out = out.data();
+        stream.avail_out = out.size();
 
-        if (setjmp(png_jmpbuf(png)))
-            exit(EXIT_FAILURE);
+        adler = adler32(0, NULL, 0);
 
-        png_init_io(png, file);
+        auto const feed = [&](u_char const* bytes, size_t n) {
+            adler = adler32(adler, bytes, n);
 
-        auto color_type = alpha ? PNG_COLOR_TYPE_RGBA : PNG_COLOR_TYPE_RGB;
+            stream.next_in = const_cast<u_char*>(bytes);
+            stream.avail_in = n;
 
-        png_set_IHDR(png, info, m_width, m_height, 8, color_type, PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
-        png_write_info(png, info);
+            status = deflate(&stream, Z_NO_FLUSH);
+            assert(status == Z_OK && !stream.avail_in);
+        };
 
-        if (!alpha)
-            png_set_filler(png, 0, PNG_FILLER_AFTER);
+        if (alpha && options.filter == PNGOptions::FILTER_NONE) {
+            // RGBA is already PNG byte order, so unfiltered rows are fed
+            // straight from the image
+            auto const none = u_char { PNGOptions::FILTER_NONE };
 
-        assert(m_image.size());
+            for (auto y = first; y < last; y++) {
+                feed(&none, 1);
+
+                for (auto x = 0; x < m_width;) {
+                    auto const n = m_image.run(x, m_width - x);
+
+                    feed(reinterpret_cast<u_char const*>(&m_image[x, y]), n * sizeof(RGBA));
+                    x += n;
+                }
+            }
+        } else {
+            auto const candidates = options.filter == PNGOptions::FILTER_ADAPTIVE ? PNGOptions::FILTER_ADAPTIVE : 1;
+
+            auto previous = std::vector<u_char>(row_bytes, 0);
+            auto current = std::vector<u_char>(row_bytes);
+            auto filtered = std::vector<u_char>(scanline * candidates);
+
+            if (first > 0)
+                pack_row(first - 1, alpha, previous.data());
+
+            for (auto y = first; y < last; y++) {
+                pack_row(y, alpha, current.data());
+
+                if (candidates == 1) {
+                    filter_row(options.filter, current.data(), previous.data(), row_bytes, bpp, filtered.data());
+                    feed(filtered.data(), scanline);
+                } else {
+                    // Pick the filter with the smallest sum of absolute
+                    // differences, the heuristic libpng uses
+                    auto best = filtered.data();
+                    auto best_sum = std::numeric_limits<uint64_t>::max();
+
+                    for (auto type = 0; type < candidates; type++) {
+                        auto* const line = filtered.data() + type * scanline;
+                        auto sum = uint64_t {};
+
+                        filter_row(type, current.data(), previous.data(), row_bytes, bpp, line);
+
+                        for (auto i = 1; i < scanline; i++)
+                            sum += std::abs(static_cast<int8_t>(line[i]));
+
+                        if (sum < best_sum) {
+                            best = line;
+                            best_sum = sum;
+                        }
+                    }
+
+                    feed(best, scanline);
+                }
+
+                std::swap(previous, current);
+            }
+        }
 
-        auto rows = (png_bytep*)malloc(sizeof(png_bytep) * m_height);
+        stream.avail_in = 0;
+        status = deflate(&stream, last == m_height ? Z_FINISH : Z_FULL_FLUSH);
+        assert(status == (last == m_height ? Z_STREAM_END : Z_OK));
 
-        for (auto i = 0; i < m_height; i++)
-            rows[i] = (png_byte*)malloc(png_get_rowbytes(png, info));
+        out.resize(out.size() - stream.avail_out);
+        deflateEnd(&stream);
+    }
+
+    // Packs row y as 8-bit RGBA or RGB samples
+    void pack_row(int y, bool alpha, u_char* out) const
+    {
+        for (auto x = 0; x < m_width; x++) {
+            auto const& color = m_image[x, y];
 
-        for (auto i = 0; i < m_height; i++) {
-            auto row = rows[i];
+            *out++ = color.ch.r;
+            *out++ = color.ch.g;
+            *out++ = color.ch.b;
 
-            for (auto j = 0; j < m_width; j++) {
-                auto const& color = m_image[j + i * m_width];
-                auto* const pixel = &(row[j * 4]);
+            if (alpha)
+                *out++ = color.ch.a;
+        }
+    }
 
-                pixel[0] = color.ch.r;
-                pixel[1] = color.ch.g;
-                pixel[2] = color.ch.b;
-                pixel[3] = color.ch.a;
+    // Writes the scanline of row, filtered with type against prior, to out
+    static void filter_row(int type, u_char const* row, u_char const* prior, size_t n, int bpp, u_char* out)
+    {
+        *out++ = type;
+
+        for (auto i = 0; i < n; i++) {
+            int const a = i >= bpp ? row[i - bpp] : 0;
+            int const b = prior[i];
+            int const c = i >= bpp ? prior[i - bpp] : 0;
+
+            switch (type) {
+            case PNGOptions::FILTER_SUB:
+                out[i] = row[i] - a;
+                break;
+            case PNGOptions::FILTER_UP:
+                out[i] = row[i] - b;
+                break;
+            case PNGOptions::FILTER_AVERAGE:
+                out[i] = row[i] - (a + b) / 2;
+                break;
+            case PNGOptions::FILTER_PAETH: {
+                auto const p = a + b - c;
+                auto const pa = std::abs(p - a);
+                auto const pb = std::abs(p - b);
+                auto const pc = std::abs(p - c);
+
+                out[i] = row[i] - (pa <= pb && pa <= pc ? a : pb <= pc ? b : c);
+                break;
+            }
+            default:
+                out[i] = row[i];
             }
         }
+    }
 
-        png_write_image(png, rows);
-        png_write_end(png, NULL);
+public:
+    // Options of every PNG written, see PNGOptions
+    static inline PNGOptions png_options {};
+
+    // Writes the image in the format named by filename, see format_of(). "-",
+    // optionally behind a format prefix, writes to standard output.
+    void write(std::string const& filename, bool alpha = true) const
+    {
+        assert(m_image.size());
+
+        auto const file = open_file(filename, "wb");
+
+        switch (format_of(filename)) {
+        case FORMAT_PPM:
+            write_pnm(file.get(), false);
+            break;
+        case FORMAT_PAM:
+            write_pnm(file.get(), alpha);
+            break;
+        case FORMAT_QOI:
+            write_qoi(file.get(), alpha);
+            break;
+        case FORMAT_RAW:
+            write_raw(file.get());
+            break;
+        default:
+            write_png(file.get(), alpha);
+        }
 
-        for (auto i = 0; i < m_height; i++)
-            free(rows[i]);
+        if (fflush(file.get()) || ferror(file.get()))
+            throw std::runtime_error("Cannot write image '" + filename + "'.");
+    }
 
-        free(rows);
+private:
+    // PAM with alpha, binary PPM without
+    void write_pnm(FILE* file, bool alpha) const
+    {
+        if (alpha)
+            fprintf(file, "P7\nWIDTH %d\nHEIGHT %d\nDEPTH 4\nMAXVAL 255\nTUPLTYPE RGB_ALPHA\nENDHDR\n", m_width, m_height);
+        else
+            fprintf(file, "P6\n%d %d\n255\n", m_width, m_height);
+
+        if (alpha) {
+            write_pixels(file);
+            return;
+        }
+
+        auto row = std::vector<u_char>(static_cast<size_t>(m_width) * 3);
+
+        for (auto y = 0; y < m_height; y++) {
+            pack_row(y, false, row.data());
+            fwrite(row.data(), 1, row.size(), file);
+        }
+    }
+
+    void write_qoi(FILE* file, bool alpha) const
+    {
+        auto out = std::vector<u_char> {};
+        out.reserve(14 + static_cast<size_t>(m_width) * m_height * (alpha ? 5 : 4) + 8);
+
+        auto const put32 = [&out](uint32_t value) {
+            for (auto shift = 24; shift >= 0; shift -= 8)
+                out.push_back(value >> shift);
+        };
+
+        out.insert(out.end(), { 'q', 'o', 'i', 'f' });
+        put32(m_width);
+        put32(m_height);
+        out.push_back(alpha ? 4 : 3);
+        out.push_back(0);
+
+        auto index = std::array<RGBA, 64> {};
+        index.fill(RGBA { 0u });
+
+        auto previous = RGBA { 0x000000FFu };
+        auto run = 0;
+
+        for (auto y = 0; y < m_height; y++)
+            for (auto x = 0; x < m_width; x++) {
+                auto pixel = m_image[x, y];
+
+                if (!alpha)
+                    pixel.ch.a = 255;
+
+                auto const last = y == m_height - 1 && x == m_width - 1;
+
+                if (pixel.value == previous.value) {
+                    if (++run == 62 || last) {
+                        out.push_back(0xC0 | (run - 1));
+                        run = 0;
+                    }
+
+                    continue;
+                }
+
+                if (run) {
+                    out.push_back(0xC0 | (run - 1));
+                    run = 0;
+                }
+
+                auto const hash = qoi_hash(pixel);
+
+                if (index[hash].value == pixel.value) {
+                    out.push_back(hash);
+                } else {
+                    index[hash] = pixel;
+
+                    if (pixel.ch.a == previous.ch.a) {
+                        auto const dr = static_cast<int8_t>(pixel.ch.r - previous.ch.r);
+                        auto const dg = static_cast<int8_t>(pixel.ch.g - previous.ch.g);
+                        auto const db = static_cast<int8_t>(pixel.ch.b - previous.ch.b);
+                        auto const dr_dg = dr - dg;
+                        auto const db_dg = db - dg;
+
+                        if (dr >= -2 && dr <= 1 && dg >= -2 && dg <= 1 && db >= -2 && db <= 1) {
+                            out.push_back(0x40 | (dr + 2) << 4 | (dg + 2) << 2 | (db + 2));
+                        } else if (dg >= -32 && dg <= 31 && dr_dg >= -8 && dr_dg <= 7 && db_dg >= -8 && db_dg <= 7) {
+                            out.push_back(0x80 | (dg + 32));
+                            out.push_back((dr_dg + 8) << 4 | (db_dg + 8));
+                        } else {
+                            out.insert(out.end(), { 0xFE, pixel.ch.r, pixel.ch.g, pixel.ch.b });
+                        }
+                    } else {
+                        out.insert(out.end(), { 0xFF, pixel.ch.r, pixel.ch.g, pixel.ch.b, pixel.ch.a });
+                    }
+                }
+
+                previous = pixel;
+            }
+
+        out.insert(out.end(), { 0, 0, 0, 0, 0, 0, 0, 1 });
+
+        fwrite(out.data(), 1, out.size(), file);
+    }
+
+    void write_raw(FILE* file) const
+    {
+        auto const header = std::array<uint32_t, 2> { htole32(m_width), htole32(m_height) };
 
-        fclose(file);
+        fwrite("RGBA", 1, 4, file);
+        fwrite(header.data(), sizeof(uint32_t), 2, file);
+
+        write_pixels(file);
+    }
+
+    // RGBA rows straight from the image storage
+    void write_pixels(FILE* file) const
+    {
+        for (auto y = 0; y < m_height; y++)
+            for (auto x = 0; x < m_width;) {
+                auto const n = m_image.run(x, m_width - x);
+
+                fwrite(&m_image[x, y], sizeof(RGBA), n, file);
+                x += n;
+            }
+    }
+
+    // PNG whose rows are compressed in parallel stripes, one IDAT chunk per
+    // stripe. The stripes are independent deflate streams joined into a
+    // single zlib stream, pigz style, so the output is a plain PNG that is
+    // slightly larger than a serial encode.
+    void write_png(FILE* file, bool alpha) const
+    {
+        auto const& options = png_options;
+
+        auto const threads = options.stripes ? options.stripes : Topology::get().workers();
+        auto const stripes = std::clamp<int>(threads, 1, std::max(1, m_height / 16));
+
+        // First row of stripe, and the row count for stripe == stripes
+        auto const first_row = [&](int stripe) { return static_cast<int>(static_cast<int64_t>(stripe) * m_height / stripes); };
+
+        auto compressed = std::vector<std::vector<u_char>>(stripes);
+        auto checksums = std::vector<uLong>(stripes);
+        auto pool = std::vector<std::thread> {};
+
+        auto const encode = [&](int i) {
+            deflate_stripe(first_row(i), first_row(i + 1), alpha, options, compressed[i], checksums[i]);
+        };
+
+        for (auto i = 1; i < stripes; i++)
+            pool.push_back(std::thread(encode, i));
+
+        encode(0);
+
+        for (auto&& thread : pool)
+            thread.join();
+
+        // Checksum of the whole stream from those of the stripes
+        auto const stripe_bytes = [&](int i) {
+            return static_cast<uLong>(first_row(i + 1) - first_row(i)) * (m_width * (alpha ? 4 : 3) + 1);
+        };
+
+        auto adler = checksums[0];
+
+        for (auto i = 1; i < stripes; i++)
+            adler = adler32_combine(adler, checksums[i], stripe_bytes(i));
+
+        auto const big_endian = [](uint32_t value) {
+            return std::array<u_char, 4> {
+                static_cast<u_char>(value >> 24),
+                static_cast<u_char>(value >> 16),
+                static_cast<u_char>(value >> 8),
+                static_cast<u_char>(value)
+            };
+        };
+
+        auto const chunk = [&](char const* type, std::initializer_list<std::pair<u_char const*, size_t>> parts) {
+            auto length = size_t {};
+            auto crc = crc32(0, reinterpret_cast<u_char const*>(type), 4);
+
+            for (auto [data, n] : parts) {
+                length += n;
+                crc = crc32(crc, data, n);
+            }
+
+            fwrite(big_endian(length).data(), 1, 4, file);
+            fwrite(type, 1, 4, file);
+
+            for (auto [data, n] : parts)
+                fwrite(data, 1, n, file);
+
+            fwrite(big_endian(crc).data(), 1, 4, file);
+        };
+
+        static constexpr u_char signature[] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+        fwrite(signature, 1, sizeof(signature), file);
+
+        auto header = std::array<u_char, 13> {};
+        auto const width = big_endian(m_width);
+        auto const height = big_endian(m_height);
+
+        std::copy(width.begin(), width.end(), header.begin());
+        std::copy(height.begin(), height.end(), header.begin() + 4);
+        header[8] = 8;
+        header[9] = alpha ? PNG_COLOR_TYPE_RGBA : PNG_COLOR_TYPE_RGB;
+
+        chunk("IHDR", { { header.data(), header.size() } });
+
+        // zlib header with the level hint, padded to a multiple of 31
+        auto const level = options.level < 0 ? 6 : options.level;
+        auto const hint = level < 2 ? 0 : level < 6 ? 1 : level == 6 ? 2 : 3;
+        auto zlib = std::array<u_char, 2> { 0x78, static_cast<u_char>(hint << 6) };
+        zlib[1] += 31 - (zlib[0] * 256 + zlib[1]) % 31;
+
+        auto const trailer = big_endian(adler);
+
+        for (auto i = 0; i < stripes; i++)
+            chunk("IDAT", {
+                { zlib.data(), i == 0 ? zlib.size() : 0 },
+                { compressed[i].data(), compressed[i].size() },
+                { trailer.data(), i == stripes - 1 ? trailer.size() : 0 },
+            });
+
+        chunk("IEND", {});
+    }
+};
+
+// An image decoded on a background thread. Its size is known and its top
+// rows can be read as soon as they are decoded, so work that only needs the
+// top of the image can start before the rest has arrived.
+class PendingImage {
+private:
+    Image m_image;
+    int m_rows { -1 };
+    std::exception_ptr m_error;
+
+    mutable std::mutex m_mtx;
+    mutable std::condition_variable m_convar;
+
+    std::thread m_decoder;
+
+    // Waits until ready() holds or decoding failed, which is rethrown here
+    template <typename Ready>
+    void wait(Ready&& ready) const
+    {
+        auto lock = std::unique_lock<std::mutex>(m_mtx);
+
+        m_convar.wait(lock, [&] { return m_error || ready(); });
+
+        if (m_error)
+            std::rethrow_exception(m_error);
+    }
+
+public:
+    PendingImage(std::string filename)
+        : m_decoder([this, filename = std::move(filename)] {
+            try {
+                m_image.open(filename, [this](int rows) {
+                    {
+                        auto lock = std::unique_lock<std::mutex>(m_mtx);
+                        m_rows = rows;
+                    }
+
+                    m_convar.notify_all();
+                });
+            } catch (...) {
+                {
+                    auto lock = std::unique_lock<std::mutex>(m_mtx);
+                    m_error = std::current_exception();
+                }
+
+                m_convar.notify_all();
+            }
+        })
+    {
+    }
+
+    PendingImage(PendingImage const&) = delete;
+    PendingImage& operator=(PendingImage const&) = delete;
+
+    ~PendingImage() { m_decoder.join(); }
+
+    // The image once its size is known, with only the rows waited for by
+    // wait_rows() safe to read
+    Image const& image() const
+    {
+        wait([this] { return m_rows >= 0; });
+
+        return m_image;
+    }
+
+    // Waits until the first rows rows, or all of them if there are fewer,
+    // have been decoded
+    void wait_rows(int rows) const
+    {
+        // The size is only safe to read once m_rows is set
+        wait([this, rows] { return m_rows >= 0 && m_rows >= std::min(rows, m_image.height()); });
+    }
+
+    // The whole image, once decoded
+    Image const& get() const
+    {
+        wait([this] { return m_rows >= 0 && m_rows == m_image.height(); });
 
-        png_destroy_write_struct(&png, &info);
+        return m_image;
     }
 };
@@ -0,0 +1,167 @@
+#pragma once
+
+#include <algorithm>
+#include <future>
+#include <numeric>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "Image.h"
+#include "Utility.h"
+
+// Rows [y, y + height) of a texture holding one exemplar in its first width
+// columns. Candidate patches lie wholly inside one band.
+struct Band {
+    int y;
+    int width;
+    int height;
+};
+
+// A family of exemplars searched as one texture. They are stacked top to
+// bottom in an atlas, so the matchers sweep every exemplar in a single scan
+// over one contiguous image and address candidates by their atlas offset,
+// which locate() turns back into (exemplar, offset). The bands are sized
+// from the image headers, so the memory limit is checked before any pixels
+// are decoded. Loading is lazy only in that nothing is decoded until atlas()
+// is first called: every scan sweeps all bands, so that call decodes every
+// exemplar, in parallel, freeing each once it is copied into its band.
+class ExemplarLibrary {
+private:
+    std::vector<std::string> m_paths;
+    std::vector<Band> m_bands;
+    Image m_atlas;
+
+    // Exemplars decoded while sizing the bands, only those read from a
+    // stream, whose header cannot be read on its own
+    std::vector<Image> m_exemplars;
+
+    bool m_loaded {};
+    size_t m_memory_limit {};
+
+public:
+    struct Source {
+        int exemplar;
+        Coordinate offset;
+    };
+
+    ExemplarLibrary(std::vector<std::string> paths)
+        : m_paths(std::move(paths))
+    {
+        assert(!m_paths.empty());
+    }
+
+    // Rejects libraries whose atlas would take more than bytes, 0 for no limit
+    void set_memory_limit(size_t bytes) { m_memory_limit = bytes; }
+
+    Image const& atlas()
+    {
+        if (!m_loaded)
+            load();
+
+        return m_atlas;
+    }
+
+    std::vector<Band> const& bands()
+    {
+        if (m_bands.empty())
+            measure();
+
+        return m_bands;
+    }
+
+    size_t size() const { return m_paths.size(); }
+    std::string const& path(int exemplar) const { return m_paths[exemplar]; }
+
+    // Bytes held by the pixels of one exemplar, and by the whole atlas
+    // including the padding right of exemplars narrower than the widest
+    size_t memory(int exemplar) const { return static_cast<size_t>(m_bands[exemplar].width) * m_bands[exemplar].height * sizeof(RGBA); }
+    size_t memory() const { return static_cast<size_t>(m_atlas.width()) * m_atlas.height() * sizeof(RGBA); }
+
+    // Exemplar and offset within it of an atlas offset
+    Source locate(Coordinate offset) const
+    {
+        auto const band = std::upper_bound(m_bands.begin(), m_bands.end(), offset.y, [](int y, Band const& band) {
+            return y < band.y;
+        }) - 1;
+
+        return { static_cast<int>(band - m_bands.begin()), offset - Coordinate { 0, band->y } };
+    }
+
+private:
+    // Sizes the bands and checks the atlas against the memory limit
+    void measure()
+    {
+        m_exemplars.resize(m_paths.size());
+
+        auto width = 0;
+        auto height = 0;
+
+        for (auto i = 0; i < m_paths.size(); i++) {
+            auto size = Coordinate {};
+
+            if (Image::is_stream(m_paths[i])) {
+                m_exemplars[i] = Image(m_paths[i]);
+                size = { m_exemplars[i].width(), m_exemplars[i].height() };
+            } else {
+                size = Image::size_of(m_paths[i]);
+            }
+
+            m_bands.push_back({ height, size.x, size.y });
+            width = std::max(width, size.x);
+            height += size.y;
+        }
+
+        if (m_memory_limit && static_cast<size_t>(width) * height * sizeof(RGBA) > m_memory_limit)
+            throw std::runtime_error("Exemplar library needs " + std::to_string(static_cast<size_t>(width) * height * sizeof(RGBA))
+                + " bytes, more than its limit of " + std::to_string(m_memory_limit) + ".");
+    }
+
+    // Decodes exemplar, unless that happened while sizing the bands, and
+    // checks it against the size its header gave
+    Image decode(int exemplar)
+    {
+        auto image = m_exemplars[exemplar].width() ? std::move(m_exemplars[exemplar]) : Image(m_paths[exemplar]);
+
+        if (image.width() != m_bands[exemplar].width || image.height() != m_bands[exemplar].height)
+            throw std::runtime_error("Exemplar '" + m_paths[exemplar] + "' changed size while loading.");
+
+        return image;
+    }
+
+    void load()
+    {
+        if (m_bands.empty())
+            measure();
+
+        // A single exemplar is its own atlas
+        if (m_paths.size() == 1) {
+            m_atlas = decode(0);
+            m_loaded = true;
+            return;
+        }
+
+        auto const width = std::ranges::max(m_bands, {}, &Band::width).width;
+        m_atlas = Image(width, m_bands.back().y + m_bands.back().height);
+
+        // Every exemplar goes straight into its own band, so only those
+        // being decoded take memory besides the atlas
+        auto copying = std::vector<std::future<void>> {};
+
+        for (auto i = 0; i < m_paths.size(); i++)
+            copying.push_back(std::async(std::launch::async, [this, i] {
+                auto const exemplar = decode(i);
+                auto const& band = m_bands[i];
+
+                for (auto y = 0; y < band.height; y++)
+                    for_each_span(m_atlas, Coordinate { 0, band.y + y }, exemplar, Coordinate { 0, y }, band.width, [](RGBA* to, RGBA const* from, int, int n) {
+                        memcpy(to, from, n * sizeof(RGBA));
+                    });
+            }));
+
+        for (auto& copied : copying)
+            copied.get();
+
+        m_loaded = true;
+    }
+};
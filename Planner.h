@@ -0,0 +1,307 @@
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+
+#include "Library.h"
+#include "Quilt.h"
+#include "Topology.h"
+#include "Transfer.h"
+
+// The kernel list the build was made with as a string, see QUILT_KERNELS
+#define PLANNER_STRING(...) #__VA_ARGS__
+#define PLANNER_EXPANDED_STRING(...) PLANNER_STRING(__VA_ARGS__)
+
+// Size of a synthesis job as far as the cost model is concerned. Transfers
+// run passes with shrinking patches and also score every candidate against
+// the constraint. Quilts may search several views of every band.
+struct Job {
+    std::vector<Band> bands;
+    int patch;
+    int overlap;
+    int K;
+    int width;
+    int height;
+    unsigned threads;
+    int passes { 1 };
+    bool transfer {};
+    int views { 1 };
+};
+
+// Matcher configuration a Planner picked, with its estimated wall time
+struct Plan {
+    int matching { Quilt::MATCH_RGBA };
+    int stride { 1 };
+    int keep { 8 };
+    double estimate {};
+
+    std::string describe() const
+    {
+        return std::string(matching == Quilt::MATCH_LUMINANCE ? "luminance" : "rgba") + " matching, stride " + std::to_string(stride)
+            + (stride > 1 ? ", keep " + std::to_string(keep) : "");
+    }
+};
+
+// Picks the matcher and subsampling for a job from a cost model of this
+// machine. The model prices a scanned candidate as a fixed cost plus a cost
+// per overlap pixel, and per patch pixel against a constraint, for each
+// matcher with specialized and generic kernels, plus the seam and copy of
+// every chunk per patch pixel. The prices come from synthesizing small
+// random jobs on one thread and are cached per machine and build, so only
+// the first run pays for the calibration.
+class Planner {
+private:
+    // Seconds per candidate and per overlap pixel of a candidate, and per
+    // patch pixel of a correspondence error, by matcher and by whether the
+    // kernels are specialized, and per patch pixel of a chunk's seams and
+    // copy
+    struct Costs {
+        std::array<std::array<double, 2>, 2> candidate {};
+        std::array<std::array<double, 2>, 2> overlap_pixel {};
+        std::array<std::array<double, 2>, 2> correspondence_pixel {};
+        double chunk_pixel {};
+    };
+
+    Costs m_costs;
+
+    // Small and large patch/overlap pairs to fit the costs to, by whether
+    // they have specialized kernels
+    static constexpr std::array<std::array<std::array<int, 2>, 2>, 2> CALIBRATION_SIZES = { {
+        { { { 12, 3 }, { 40, 7 } } },
+        { { { 18, 3 }, { 32, 6 } } },
+    } };
+
+    // Identifies the machine and the build a cache was calibrated on. The
+    // kernels specialized at build time and the image layout move the costs
+    // as much as the processor does.
+    static std::string machine()
+    {
+        auto host = std::array<char, 256> {};
+        gethostname(host.data(), host.size() - 1);
+
+        auto cpuinfo = std::ifstream("/proc/cpuinfo");
+        auto line = std::string {};
+        auto model = std::string {};
+
+        while (std::getline(cpuinfo, line))
+            if (line.starts_with("model name")) {
+                model = line.substr(line.find(':') + 2);
+                break;
+            }
+
+        auto build = std::string(PLANNER_EXPANDED_STRING(QUILT_KERNELS));
+
+#ifdef IMAGE_TILE
+        build += " tiles of " + std::to_string(IMAGE_TILE);
+#endif
+
+        return std::string(host.data()) + '/' + model + '/' + build;
+    }
+
+    static std::filesystem::path cache_path()
+    {
+        auto const* const xdg = std::getenv("XDG_CACHE_HOME");
+        auto const* const home = std::getenv("HOME");
+        auto const root = xdg && *xdg ? std::filesystem::path(xdg) : std::filesystem::path(home ? home : "/tmp") / ".cache";
+
+        return root / "synthesis" / "planner-costs";
+    }
+
+    bool load(std::filesystem::path const& path)
+    {
+        auto file = std::ifstream(path);
+        auto key = std::string {};
+
+        if (!std::getline(file, key) || key != machine())
+            return false;
+
+        for (auto* costs : { &m_costs.candidate, &m_costs.overlap_pixel, &m_costs.correspondence_pixel })
+            for (auto& by_matcher : *costs)
+                for (auto& cost : by_matcher)
+                    file >> cost;
+
+        return static_cast<bool>(file >> m_costs.chunk_pixel);
+    }
+
+    void save(std::filesystem::path const& path) const
+    {
+        auto error = std::error_code {};
+        std::filesystem::create_directories(path.parent_path(), error);
+
+        auto file = std::ofstream(path);
+
+        file.precision(6);
+        file << machine() << '\n';
+
+        for (auto const* costs : { &m_costs.candidate, &m_costs.overlap_pixel, &m_costs.correspondence_pixel }) {
+            for (auto const& by_matcher : *costs)
+                for (auto cost : by_matcher)
+                    file << cost << ' ';
+
+            file << '\n';
+        }
+
+        file << m_costs.chunk_pixel << '\n';
+    }
+
+    static double overlap_pixels(int patch, int overlap) { return (2. * patch - overlap) * overlap; }
+
+    double overlap_cost(int matching, bool specialized, int patch, int overlap) const
+    {
+        return m_costs.candidate[matching][specialized] + m_costs.overlap_pixel[matching][specialized] * overlap_pixels(patch, overlap);
+    }
+
+    // Synthesizes small seeded jobs from noise on one thread with a small
+    // and a large patch for each matcher and kernel flavour, and one-pass
+    // transfers for the correspondence term, and reads the prices off the
+    // scan timers
+    void calibrate()
+    {
+        auto texture = Image(128, 128);
+        auto constraint = Image(72, 72);
+
+        // A generator of its own, so that the caller's stays unseeded
+        auto generator = std::mt19937(0x9E3779B9u);
+
+        for (auto* image : { &texture, &constraint })
+            for (auto y = 0; y < image->height(); y++)
+                for (auto x = 0; x < image->width(); x++)
+                    (*image)[x, y] = RGBA { static_cast<uint32_t>(generator()) | 0xFF000000u };
+
+        for (auto matching : { Quilt::MATCH_RGBA, Quilt::MATCH_LUMINANCE })
+            for (auto specialized : { 0, 1 }) {
+                auto per_candidate = std::array<double, 2> {};
+                auto pixels = std::array<double, 2> {};
+
+                for (auto i = 0; i < 2; i++) {
+                    auto const [patch, overlap] = CALIBRATION_SIZES[specialized][i];
+
+                    auto quilt = Quilt(texture, 72, 72);
+                    quilt.set_threads(1);
+                    quilt.set_seed(1);
+                    quilt.set_matching(matching);
+                    quilt.synthesize(patch, overlap, 3);
+
+                    per_candidate[i] = quilt.scan_time() / quilt.scanned_candidates();
+                    pixels[i] = overlap_pixels(patch, overlap);
+
+                    if (matching == Quilt::MATCH_RGBA && specialized && !i)
+                        m_costs.chunk_pixel = quilt.chunk_overhead() / quilt.chunks_timed() / (patch * patch);
+                }
+
+                auto const slope = std::max((per_candidate[1] - per_candidate[0]) / (pixels[1] - pixels[0]), 0.);
+
+                m_costs.overlap_pixel[matching][specialized] = slope;
+                m_costs.candidate[matching][specialized] = std::max(per_candidate[0] - slope * pixels[0], 0.);
+            }
+
+        for (auto matching : { Quilt::MATCH_RGBA, Quilt::MATCH_LUMINANCE })
+            for (auto specialized : { 0, 1 }) {
+                auto const patch = CALIBRATION_SIZES[specialized][0][0];
+
+                auto transfer = Transfer(texture, constraint);
+                transfer.set_threads(1);
+                transfer.set_seed(1);
+                transfer.set_matching(matching);
+                transfer.set_correspondence(matching);
+                transfer.synthesize(patch, 1, 3);
+
+                // Transfers pick their own overlap
+                auto const overlap = std::max(patch / 6, 3);
+                auto const per_candidate = transfer.scan_time() / transfer.scanned_candidates();
+                auto const correspondence = per_candidate - overlap_cost(matching, specialized, patch, overlap);
+
+                m_costs.correspondence_pixel[matching][specialized] = std::max(correspondence, 0.) / (patch * patch);
+            }
+    }
+
+public:
+    // Loads the cost model of this machine, calibrating it first if there
+    // is none cached or recalibrate is set
+    Planner(bool recalibrate = false)
+    {
+        auto const path = cache_path();
+
+        if (!recalibrate && load(path))
+            return;
+
+        auto const start = std::chrono::steady_clock::now();
+
+        calibrate();
+        save(path);
+
+        std::cout << "[Plan] calibrated in " << std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count()
+                  << "s, cached in " << path.string() << '\n';
+    }
+
+    // Estimated wall time of job with the given matcher and subsampling
+    double estimate(Job const& job, int matching, int stride, int keep) const
+    {
+        auto total = 0.;
+        auto patch = job.patch;
+        auto overlap = job.overlap;
+
+        for (auto pass = 0; pass < job.passes && patch > 3; pass++) {
+            auto candidates = 0.;
+
+            for (auto const& band : job.bands) {
+                auto const x = std::max(band.width - patch, 0);
+                auto const y = std::max(band.height - patch, 0);
+
+                candidates += std::ceil(x / static_cast<double>(stride)) * std::ceil(y / static_cast<double>(stride));
+            }
+
+            // The dense search around each kept grid point
+            if (stride > 1)
+                candidates += keep * ((2. * stride + 1) * (2 * stride + 1) - 1);
+
+            auto const chunk = patch - overlap;
+            auto const chunks = std::ceil(job.width / static_cast<double>(chunk)) * std::ceil(job.height / static_cast<double>(chunk));
+            auto const specialized = Quilt::specialized(patch, overlap);
+
+            auto per_candidate = overlap_cost(matching, specialized, patch, overlap);
+
+            if (job.transfer)
+                per_candidate += m_costs.correspondence_pixel[matching][specialized] * patch * patch;
+
+            // Every further view scans the same offsets with generic kernels
+            per_candidate += (job.views - 1) * overlap_cost(matching, false, patch, overlap);
+
+            total += chunks * (candidates * per_candidate + m_costs.chunk_pixel * patch * patch);
+
+            // Later transfer passes shrink the patch as Transfer::synthesize does
+            patch = static_cast<int>((2. / 3.) * patch);
+            overlap = std::max(patch / 6, 3);
+        }
+
+        return total / std::max(job.threads, 1u);
+    }
+
+    // The most thorough plan expected to finish within target seconds:
+    // exhaustive scans before subsampled ones and RGBA before luminance at
+    // each density. Falls back to the cheapest plan if none fits.
+    Plan choose(Job const& job, double target, int keep = 8) const
+    {
+        auto plan = Plan {};
+
+        for (auto stride : { 1, 2, 3, 4, 6, 8 })
+            for (auto matching : { Quilt::MATCH_RGBA, Quilt::MATCH_LUMINANCE }) {
+                plan = { matching, stride, keep, estimate(job, matching, stride, keep) };
+
+                if (plan.estimate <= target)
+                    return plan;
+            }
+
+        return plan;
+    }
+};
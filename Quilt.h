@@ -1,25 +1,182 @@
 #pragma once
 
 #include <algorithm>
+#include <atomic>
+#include <bit>
+#include <chrono>
 #include <condition_variable>
+#include <csignal>
 #include <deque>
+#include <filesystem>
+#include <future>
+#include <limits>
 #include <mutex>
+#include <optional>
 #include <queue>
 #include <random>
+#include <stdexcept>
+#include <string>
 #include <thread>
+#include <type_traits>
 #include <unordered_set>
 #include <vector>
 
+#include <sys/wait.h>
+
+#include "Checkpoint.h"
 #include "Image.h"
+#include "Library.h"
+#include "Shard.h"
+#include "Topology.h"
 #include "Utility.h"
 
 class MultiQuilt;
 
+// Patch/overlap pairs that get compile-time specialized matcher and seam
+// kernels, as a list of KERNEL(patch, overlap). Any other configuration
+// runs the generic kernels.
+#ifndef QUILT_KERNELS
+#    define QUILT_KERNELS KERNEL(18, 3) KERNEL(24, 4) KERNEL(32, 6) KERNEL(48, 8) KERNEL(64, 10)
+#endif
+
+// Adds its own lifetime, in nanoseconds, to total
+struct ScopedTimer {
+    std::atomic<uint64_t>& total;
+    std::chrono::steady_clock::time_point start { std::chrono::steady_clock::now() };
+
+    ~ScopedTimer()
+    {
+        total += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+    }
+};
+
+struct Span {
+    int start;
+    int end;
+};
+
+// Boundary-cut mask stored as [start, end) runs of texture pixels per row.
+// Below the top overlap every row is a single run starting right of the
+// vertical seam; rows inside the top overlap may be split by the horizontal
+// seam. When re-synthesizing, runs may also end at a right seam and rows in
+// the bottom overlap may be split by a bottom seam.
+struct Mask {
+    std::vector<Span> spans;
+    std::vector<int> rows;
+
+    void reserve(int patch, int overlap)
+    {
+        spans.reserve(patch + 2 * overlap * (patch / 2 + 1));
+        rows.reserve(patch + 1);
+    }
+
+    void clear()
+    {
+        spans.clear();
+        rows.clear();
+        rows.push_back(0);
+    }
+
+    void add(int start, int end)
+    {
+        if (start < end)
+            spans.push_back({ start, end });
+    }
+
+    void end_row() { rows.push_back(spans.size()); }
+
+    int height() const { return rows.size() - 1; }
+
+    Span const* begin(int row) const { return spans.data() + rows[row]; }
+    Span const* end(int row) const { return spans.data() + rows[row + 1]; }
+};
+
+// Per-worker buffers for the matching, seam and mask stages. Sized once by
+// reserve() at the start of a synthesis pass and reused for every chunk so
+// that the hot path does not touch the heap.
+struct Scratch {
+    std::vector<SSD> candidates;
+
+    // Best candidates by a single error term, kept by searches that remember
+    // them for later chunks
+    static constexpr int SHORTLIST = 64;
+    std::vector<SSD> shortlist;
+
+    // Best grid points of a subsampled scan, see Quilt::scan_candidates()
+    std::vector<SSD> coarse;
+
+    // Seam DP rows are padded to whole vectors with one sentinel lane in
+    // front, see Quilt::find_seam
+    std::vector<uint32_t> energy;
+    std::vector<uint32_t> cost;
+    std::vector<int32_t> path;
+    std::vector<uint32_t> row;
+    std::vector<int> vertical_cut;
+    std::vector<int> horizontal_cut;
+    std::vector<int> right_cut;
+    std::vector<int> bottom_cut;
+
+    Mask mask;
+
+    // Candidate scan density for the current chunk, see Quilt::scan_stride()
+    int scan_stride { 1 };
+    int scan_refine {};
+    size_t scanned {};
+    uint64_t scan_time {};
+
+    // Summed cost of the seams cut for the current chunk
+    uint64_t seam_energy {};
+
+    // Compared pixels of the current patch, and as a view sees them
+    std::vector<char> covered;
+    Mask view_mask;
+    Image view_target;
+    Plane view_target_luminance;
+
+    static constexpr int stride(int lanes) { return ((lanes + 7) & ~7) + 8; }
+
+    void reserve(int patch, int overlap, int K, bool views = false)
+    {
+        auto const strip = static_cast<size_t>(patch) * stride(overlap);
+
+        candidates.reserve(K + 1);
+        shortlist.reserve(std::max(K, SHORTLIST) + 1);
+        coarse.reserve(SHORTLIST + 1);
+
+        energy.assign(strip, 0);
+        cost.assign(strip, 0);
+        path.assign(strip, 0);
+        row.assign(patch, 0);
+        vertical_cut.reserve(patch);
+        horizontal_cut.reserve(patch);
+        right_cut.reserve(patch);
+        bottom_cut.reserve(patch);
+
+        mask.reserve(patch, overlap);
+
+        if (views) {
+            covered.assign(static_cast<size_t>(patch) * patch, 0);
+            view_mask.reserve(patch, overlap);
+            view_target = Image(patch, patch);
+            view_target_luminance = Plane(patch, patch, 0);
+        }
+    }
+};
+
 class Quilt {
 protected:
     Image const& m_texture;
     Image m_quilt;
 
+    // Parts of the texture candidates are taken from, the whole texture
+    // unless it is the atlas of an ExemplarLibrary
+    std::vector<Band> m_bands;
+
+    // Views searched besides the texture, see set_views(). Candidates in view
+    // v are offsets into that view moved right by v * m_view_stride.
+    int m_views { VIEWS_ORIGINAL };
+    int m_view_stride;
+
     int m_patch;
     int m_overlap;
     int m_chunk;
@@ -31,476 +188,1869 @@ protected:
     std::condition_variable m_queue_convar;
 
     multivec<int> m_status;
+    multivec<Coordinate> m_offsets;
     std::mutex m_status_mtx;
     size_t m_total_completed {};
     bool m_completed {};
 
     std::mutex m_copy_mtx;
 
+    // Seed for the per-chunk random streams, random if not set
+    std::optional<uint64_t> m_seed;
+
+    // Time budget for a whole synthesis and the deadline of the current
+    // pass. The scan rate measured so far decides how densely each chunk
+    // can search, see scan_stride().
+    std::optional<std::chrono::steady_clock::duration> m_budget;
+    std::optional<std::chrono::steady_clock::time_point> m_deadline;
+    int m_threads { 1 };
+    std::atomic<uint64_t> m_scan_time {};
+    std::atomic<uint64_t> m_scanned {};
+    std::atomic<uint64_t> m_chunk_time {};
+    std::atomic<uint64_t> m_chunk_overhead {};
+    std::atomic<size_t> m_chunks_timed {};
+    std::atomic<size_t> m_budget_fallbacks {};
+
+    // Subsampled scans: every m_subsample_stride-th offset along both axes,
+    // then a dense search around the m_subsample_best best of those
+    int m_subsample_stride { 1 };
+    int m_subsample_best {};
+
+    // Overlap error of the chosen patches over the overlap pixels they cover
+    std::atomic<uint64_t> m_overlap_error {};
+    std::atomic<uint64_t> m_overlap_pixels {};
+
+    // Energy along the seams cut by the chosen patches
+    std::atomic<uint64_t> m_seam_energy {};
+
     size_t m_max_chunk_x;
     size_t m_max_chunk_y;
 
+    // Chunks being redone by resynthesize(), empty otherwise. The others keep
+    // their pixels and constrain the redone patches from the right and below.
+    multivec<char> m_dirty;
+
+    // Periodic checkpoints, see set_checkpoint(). The quilt matches the status
+    // grid whenever m_copies equals m_marked.
+    std::string m_checkpoint_path;
+    std::chrono::steady_clock::duration m_checkpoint_interval {};
+    std::chrono::steady_clock::time_point m_checkpoint_due;
+    std::future<void> m_checkpoint_write;
+    std::optional<Checkpoint> m_resume;
+    size_t m_copies {};
+    size_t m_marked {};
+    int m_pass {};
+
+    // When the first chunk of this quilt was done, under m_status_mtx
+    std::optional<std::chrono::steady_clock::time_point> m_first_chunk;
+
+    // Matcher and seam kernels, see select_kernels()
+    struct Kernels {
+        int patch;
+        int overlap;
+
+        int (Quilt::*overlap_error)(Coordinate, Coordinate, bool, bool) const;
+        int (Quilt::*patch_error)(Image const&, Coordinate, Coordinate) const;
+        int (Quilt::*luminance_overlap_error)(Coordinate, Coordinate, bool, bool) const;
+        int (Quilt::*luminance_patch_error)(Plane const&, Coordinate, Coordinate) const;
+        std::vector<int> const& (Quilt::*vertical_seam)(Coordinate, Coordinate, Coordinate, Scratch&) const;
+        std::vector<int> const& (Quilt::*horizontal_seam)(Coordinate, Coordinate, Coordinate, Scratch&) const;
+    };
+
+    Kernels const* m_kernels {};
+
+    // Compact planes read by the matchers in MATCH_LUMINANCE mode. The quilt
+    // plane is kept up to date by copy_span().
+    int m_matching { MATCH_RGBA };
+    Plane m_texture_luminance;
+    Plane m_quilt_luminance;
+
+    // Worker placement: how many, whether each is pinned to a CPU, and
+    // copies of the texture and its plane per NUMA node, first touched by a
+    // thread on that node so that the scans read node-local memory. Workers
+    // reach their node's copy through the thread-local pointers.
+    struct Replica {
+        Image texture;
+        Plane luminance;
+    };
+
+    unsigned m_worker_threads {};
+    bool m_pin {};
+    bool m_replicate {};
+    std::vector<Replica> m_replicas;
+
+    inline static thread_local Image const* t_texture {};
+    inline static thread_local Plane const* t_texture_luminance {};
+
+    // Shared segment, shard index and first CPU of a shard process
+    ShardSegment* m_segment {};
+    int m_shard {};
+    int m_cpu_offset {};
+
+#ifdef BENCHMARK
+    std::atomic<size_t> m_chunk_allocations {};
+    std::atomic<uint64_t> m_match_time {};
+    std::atomic<uint64_t> m_seam_time {};
+#endif
+
     friend class MultiQuilt;
 
 public:
     static constexpr int SYNTHESIS_RANDOM = 1;
     static constexpr int SYNTHESIS_SIMPLE = 2;
     static constexpr int SYNTHESIS_CUT = 3;
-    static constexpr bool SSD_USE_ADDITION = false;
-    static constexpr bool SSD_USE_SUBTRACTION = true;
+    static constexpr int MATCH_RGBA = 0;
+    static constexpr int MATCH_LUMINANCE = 1;
     static constexpr bool VERTICAL_SEAM = true;
     static constexpr bool HORIZONTAL_SEAM = false;
 
+    // View v transposes if v & 4, then mirrors along x if v & 1, along y if v & 2
+    static constexpr int VIEWS = 8;
+    static constexpr int VIEWS_ORIGINAL = 0x01;
+    // Views 0, 3, 5 and 6, the texture turned by multiples of 90 degrees
+    static constexpr int VIEWS_ROTATIONS = 0x69;
+    static constexpr int VIEWS_ALL = 0xFF;
+
     Quilt(Image const& texture, int width, int height)
         : m_quilt(width, height)
         , m_texture(texture)
+        , m_bands { Band { 0, texture.width(), texture.height() } }
+        , m_view_stride(std::max(texture.width(), texture.height()))
     {
         m_queue.push({ 0, 0 });
     }
 
-    [[gnu::flatten]] void copy_patch(Coordinate quilt, Coordinate texture)
+    [[gnu::always_inline]] void copy_span(Coordinate quilt, Coordinate texture, int length)
     {
-        auto max_y = std::min(m_quilt.height(), quilt.y + m_patch);
-        auto max_x = std::min(m_quilt.width(), quilt.x + m_patch);
+        if (texture.x >= m_view_stride) {
+            copy_view_span(quilt, texture, length);
+            return;
+        }
 
-        for (auto i = 0; i < max_x - quilt.x; i++)
-            for (auto j = 0; j < max_y - quilt.y; j++) {
-                auto offset = Coordinate { i, j };
-                m_quilt[quilt + offset] = m_texture[texture + offset];
-            }
+        for_each_span(m_quilt, quilt, local_texture(), texture, length, [](RGBA* to, RGBA const* from, int, int n) {
+            memcpy(to, from, n * sizeof(RGBA));
+        });
+
+        if (m_matching == MATCH_LUMINANCE)
+            for_each_span(m_quilt_luminance, quilt, local_texture_luminance(), texture, length, [](u_char* to, u_char const* from, int, int n) {
+                memcpy(to, from, n);
+            });
     }
 
-    template <typename T>
-    [[gnu::flatten, gnu::hot]] void copy_patch(Coordinate quilt, Coordinate texture, multivec<T> mask)
+    [[gnu::flatten]] void copy_patch(Coordinate quilt, Coordinate texture)
     {
-        auto max_y = std::min(m_quilt.height(), quilt.y + m_patch);
-        auto max_x = std::min(m_quilt.width(), quilt.x + m_patch);
+        auto const height = std::min(m_quilt.height() - quilt.y, m_patch);
+        auto const width = std::min(m_quilt.width() - quilt.x, m_patch);
 
-        for (auto i = 0; i < max_x - quilt.x; i++)
-            for (auto j = 0; j < max_y - quilt.y; j++) {
-                if (!mask[i, j])
-                    continue;
+        for (auto j = 0; j < height; j++)
+            copy_span(quilt + Coordinate { 0, j }, texture + Coordinate { 0, j }, width);
 
-                auto offset = Coordinate { i, j };
-                m_quilt[quilt + offset] = m_texture[texture + offset];
-            }
+        m_copies++;
     }
 
-    Coordinate random_patch() const
+    [[gnu::flatten, gnu::hot]] void copy_patch(Coordinate quilt, Coordinate texture, Mask const& mask)
     {
-        auto p = random(m_texture.width() - m_patch);
-        auto q = random(m_texture.height() - m_patch);
+        for (auto j = 0; j < mask.height(); j++)
+            for (auto span = mask.begin(j); span != mask.end(j); span++) {
+                auto const offset = Coordinate { span->start, j };
+
+                copy_span(quilt + offset, texture + offset, span->end - span->start);
+            }
 
-        return { p, q };
+        m_copies++;
     }
 
-    template <bool use_subtraction, typename Metric>
-    [[gnu::always_inline]] void compute_metric(
-        Metric&& metric, auto& ssd,
-        auto const& quxel, auto const& patch,
-        auto const max_u, auto const max_v) const
+    // copy_span() from a transformed view, a pixel at a time
+    void copy_view_span(Coordinate quilt, Coordinate address, int length)
     {
-        for (auto u = 0; u < max_u; u++) {
-            for (auto v = 0; v < max_v; v++) {
-                auto const value = metric(quxel, patch, { u, v });
+        for (auto i = 0; i < length; i++) {
+            auto const pixel = quilt + Coordinate { i, 0 };
+            auto const texel = view_texel(address + Coordinate { i, 0 });
 
-                if constexpr (use_subtraction) {
-                    ssd -= value;
-                } else {
-                    ssd += value;
-                }
-            }
+            m_quilt[pixel] = local_texture()[texel];
+
+            if (m_matching == MATCH_LUMINANCE)
+                m_quilt_luminance[pixel] = local_texture_luminance()[texel];
         }
     }
 
-    template <bool use_subtraction, typename Metric>
-    [[gnu::always_inline]] void compute_ssd(
-        Metric&& metric, auto& ssd,
-        auto const& quxel, auto const& patch,
-        auto const init_u, auto const init_v) const
+    Image const& local_texture() const { return t_texture ? *t_texture : m_texture; }
+    Plane const& local_texture_luminance() const { return t_texture_luminance ? *t_texture_luminance : m_texture_luminance; }
+
+    // Address of the candidate in view whose patch covers the patch-sized
+    // square of the texture at texel
+    Coordinate view_address(Coordinate texel, int view) const
     {
-        auto const max_u = std::min(init_u, m_quilt.width() - quxel.x);
-        auto const max_v = std::min(init_v, m_quilt.height() - quxel.y);
+        if (!view)
+            return texel;
+
+        auto const x = view & 1 ? m_texture.width() - m_patch - texel.x : texel.x;
+        auto const y = view & 2 ? m_texture.height() - m_patch - texel.y : texel.y;
+        auto const offset = view & 4 ? Coordinate { y, x } : Coordinate { x, y };
 
-        compute_metric<use_subtraction>(metric, ssd, quxel, patch, max_u, max_v);
+        return offset + Coordinate { view * m_view_stride, 0 };
     }
 
-    template <typename Metric>
-    [[gnu::flatten]] Coordinate random_overlapping_patch(Coordinate const& quxel, int K, Metric&& compute_metric) const
+    // Texel shown at address
+    Coordinate view_texel(Coordinate address) const
     {
-        auto const top_overlap = quxel.y >= m_chunk;
-        auto const left_overlap = quxel.x >= m_chunk;
-        auto const corner_overlap = left_overlap && top_overlap;
+        auto const view = address.x / m_view_stride;
+        auto const offset = Coordinate { address.x % m_view_stride, address.y };
+        auto texel = view & 4 ? Coordinate { offset.y, offset.x } : offset;
 
-        auto queue = std::priority_queue<SSD, std::vector<SSD>, std::less<SSD>> {};
+        if (view & 1)
+            texel.x = m_texture.width() - 1 - texel.x;
 
-        for (auto x = 0; x < m_texture.width() - m_patch; x++)
-            for (auto y = 0; y < m_texture.height() - m_patch; y++) {
-                auto patch = Coordinate { x, y };
-                auto ssd = 0;
+        if (view & 2)
+            texel.y = m_texture.height() - 1 - texel.y;
 
-                if (left_overlap)
-                    compute_ssd<SSD_USE_ADDITION>(compute_metric, ssd, quxel, patch, m_overlap, m_patch);
+        return texel;
+    }
 
-                if (top_overlap)
-                    compute_ssd<SSD_USE_ADDITION>(compute_metric, ssd, quxel, patch, m_patch, m_overlap);
+    Coordinate random_patch() const
+    {
+        auto const& band = random_band();
 
-                if (corner_overlap)
-                    compute_ssd<SSD_USE_SUBTRACTION>(compute_metric, ssd, quxel, patch, m_overlap, m_overlap);
+        auto p = random(band.width - m_patch);
+        auto q = random(band.height - m_patch);
 
-                if (queue.size() < K || queue.top().ssd > ssd) {
-                    if (queue.size() == K)
-                        queue.pop();
+        if (m_views == VIEWS_ORIGINAL)
+            return { p, band.y + q };
 
-                    queue.push(SSD { ssd, patch });
-                }
-            }
+        // Any of the views, with each equally likely
+        auto pick = random(std::popcount(static_cast<unsigned>(m_views)) - 1);
 
-        auto it = random(queue.size() - 1);
-        for (auto i = 0; i < it; i++)
-            queue.pop();
+        for (auto view = 0;; view++)
+            if (m_views >> view & 1 && !pick--)
+                return view_address({ p, band.y + q }, view);
+    }
 
-#ifdef DBGLN
-        std::cout << "Match [badness: " << queue.top().ssd << "] Texture" << queue.top().coord << " -> Quilt" << quxel << '\n';
-#endif
+    // Band picked in proportion to the patches it holds
+    Band const& random_band() const
+    {
+        if (m_bands.size() == 1)
+            return m_bands.front();
+
+        auto pick = random(candidate_count() - 1);
+
+        for (auto const& band : m_bands) {
+            auto const extent = band_candidates(band);
+
+            if (pick < extent.x * extent.y)
+                return band;
 
-        return queue.top().coord;
+            pick -= extent.x * extent.y;
+        }
+
+        return m_bands.back();
     }
 
-    [[gnu::flatten]] virtual Coordinate random_overlapping_patch(Coordinate const& quxel, int K) const
+    // Offsets along x and y the scans try in band
+    Coordinate band_candidates(Band const& band) const
     {
-        auto compute_ssd = [this](Coordinate const& quxel, Coordinate const& texel, Coordinate const& coord) {
-            auto const& texture = m_texture[texel + coord];
-            auto const& quilt = m_quilt[quxel + coord];
+        return { std::max(band.width - m_patch, 0), std::max(band.height - m_patch, 0) };
+    }
 
-            return squared_difference(texture, quilt);
-        };
+    // Offsets a full scan tries across all bands
+    int candidate_count() const
+    {
+        auto count = 0;
+
+        for (auto const& band : m_bands) {
+            auto const extent = band_candidates(band);
+            count += extent.x * extent.y;
+        }
 
-        return random_overlapping_patch(quxel, K, compute_ssd);
+        return count;
     }
 
-    template <bool vertical_seam>
-    [[gnu::flatten]] std::vector<Coordinate> find_seam(
-        Coordinate quxel,
-        Coordinate texel,
-        Coordinate overlap) const
+    // Band holding the texture row y
+    Band const& band_at(int y) const
     {
-        auto max_quxel = quxel + overlap;
-        auto max_texel = texel + overlap;
+        auto band = m_bands.begin();
 
-        max_quxel.x = std::min(max_quxel.x, m_quilt.width());
-        max_quxel.y = std::min(max_quxel.y, m_quilt.height());
+        while (band + 1 != m_bands.end() && (band + 1)->y <= y)
+            band++;
 
-        auto seam_height = 0;
-        auto seam_width = 0;
+        return *band;
+    }
 
-        if constexpr (vertical_seam) {
-            seam_height = max_quxel.y - quxel.y;
-            seam_width = max_quxel.x - quxel.x;
-        } else {
-            seam_height = max_quxel.x - quxel.x;
-            seam_width = max_quxel.y - quxel.y;
-        }
+    // Overlap error of the candidate at texel against the already synthesized
+    // quilt around quxel: the top overlap rows across the whole patch plus
+    // the left overlap columns below them. Non-zero P and O fix the patch and
+    // overlap sizes at compile time and assume the patch is not clipped by
+    // the quilt edges; <0, 0> is the generic fallback. With luminance set the
+    // compact planes are compared instead of the RGBA pixels.
+    template <int P, int O, bool luminance = false>
+    [[gnu::hot]] int overlap_error(Coordinate quxel, Coordinate texel, bool left, bool top) const
+    {
+        auto const height = P ? P : std::min(m_patch, m_quilt.height() - quxel.y);
+        auto const width = P ? P : std::min(m_patch, m_quilt.width() - quxel.x);
+        auto const overlap_height = O ? O : std::min(m_overlap, height);
+        auto const overlap_width = O ? O : std::min(m_overlap, width);
+
+        auto const row = [&]<int N>(int j, int n) {
+            auto const quilt = quxel + Coordinate { 0, j };
+            auto const texture = texel + Coordinate { 0, j };
+            auto error = 0u;
+
+            auto const accumulate = [&](auto const* a, auto const* b, int, int length) {
+                error += row_error<span_length<N>>(a, b, length);
+            };
 
-        if (seam_height == 0 || seam_width == 0)
-            return {};
+            if constexpr (luminance)
+                for_each_span(m_quilt_luminance, quilt, local_texture_luminance(), texture, n, accumulate);
+            else
+                for_each_span(m_quilt, quilt, local_texture(), texture, n, accumulate);
 
-        auto seam = std::vector<Coordinate>(seam_height);
+            return error;
+        };
 
-        auto energy = std::vector<std::vector<uint64_t>>(seam_height, std::vector<uint64_t>(seam_width, 0));
-        auto matrix = std::vector<std::vector<std::pair<int, int>>>(seam_height, std::vector<std::pair<int, int>>(seam_width, std::make_pair(0, 0)));
+        auto const rows = top ? overlap_height : 0;
+        auto error = 0u;
 
-        for (auto i = 0; i < seam_height; i++) {
-            for (auto j = 0; j < seam_width; j++) {
-                auto coord = vertical_seam ? Coordinate { j, i } : Coordinate { i, j };
+        for (auto j = 0; j < rows; j++)
+            error += row.template operator()<P>(j, width);
 
-                auto texture = m_texture[texel + coord];
-                auto quilt = m_quilt[quxel + coord];
+        if (left)
+            for (auto j = rows; j < height; j++)
+                error += row.template operator()<O>(j, overlap_width);
 
-                energy[i][j] = squared_difference(quilt, texture);
-            }
-        }
-        for (auto j = 0; j < seam_width; j++)
-            matrix[0][j].first = energy[0][j];
+        return error;
+    }
 
-        for (auto i = 1; i < seam_height; i++) {
-            auto const& prev_row = matrix[i - 1];
+    // Whether the chunk next to the one at quxel in direction keeps its pixels
+    // during a resynthesize() pass, so that the patch has to blend into it
+    bool kept_neighbour(Coordinate quxel, Coordinate direction) const
+    {
+        if (!m_dirty.size())
+            return false;
 
-            for (auto j = 0; j < seam_width; j++) {
-                auto minval = prev_row[j].first;
-                auto k = 0;
+        auto const chunk = Coordinate { quxel.x / m_chunk, quxel.y / m_chunk } + direction;
 
-                if (j - 1 > 0 && prev_row[j - 1].first < minval) {
-                    minval = prev_row[j - 1].first;
-                    k = -1;
-                }
+        return chunk.x < m_max_chunk_x && chunk.y < m_max_chunk_y && !m_dirty[chunk];
+    }
 
-                if (j + 1 < seam_width && prev_row[j + 1].first < minval) {
-                    minval = prev_row[j + 1].first;
-                    k = 1;
-                }
+    // Overlap error of the candidate at texel against kept pixels in the
+    // right and bottom overlap strips of the patch at quxel. Only
+    // resynthesize() has any, so this stays out of the specialized kernels.
+    int border_error(Coordinate quxel, Coordinate texel, bool right, bool bottom) const
+    {
+        auto const height = std::min(m_patch, m_quilt.height() - quxel.y);
+        auto const width = std::min(m_patch, m_quilt.width() - quxel.x);
 
-                matrix[i][j] = std::make_pair(minval + energy[i][j], j + k);
-            }
-        }
+        auto error = 0u;
 
-        auto least_energy_element = std::min_element(
-            matrix.back().cbegin(), matrix.back().cend(),
-            [](auto const& a, auto const& b) { return a.first < b.first; });
+        auto const strip = [&](Coordinate offset, int w, int h) {
+            auto const accumulate = [&](auto const* a, auto const* b, int, int length) {
+                error += row_error(a, b, length);
+            };
 
-        seam[seam_height - 1] = Coordinate {
-            static_cast<int>(std::distance(matrix.back().cbegin(), least_energy_element)),
-            seam_height - 1
-        };
+            for (auto j = 0; j < h; j++) {
+                auto const quilt = quxel + offset + Coordinate { 0, j };
+                auto const texture = texel + offset + Coordinate { 0, j };
 
-        if (!vertical_seam) {
-            auto& back = seam[seam_height - 1];
-            std::swap(back.x, back.y);
-        }
+                if (m_matching == MATCH_LUMINANCE)
+                    for_each_span(m_quilt_luminance, quilt, local_texture_luminance(), texture, w, accumulate);
+                else
+                    for_each_span(m_quilt, quilt, local_texture(), texture, w, accumulate);
+            }
+        };
 
-        for (auto i = seam_height - 1; i-- > 0;) {
-            auto j = least_energy_element->second;
-            seam[i] = vertical_seam ? Coordinate { j, i } : Coordinate { i, j };
+        // The bottom strip includes the corner shared with the right one
+        if (right && width > m_chunk)
+            strip({ m_chunk, 0 }, width - m_chunk, bottom ? std::min(height, m_chunk) : height);
 
-            least_energy_element = matrix[i].cbegin() + j;
-        }
+        if (bottom && height > m_chunk)
+            strip({ 0, m_chunk }, width, height - m_chunk);
 
-        return seam;
+        return error;
     }
 
-    [[gnu::flatten, gnu::hot]] auto find_mask(Coordinate quxel, Coordinate texel, Coordinate max) const
+    // Error of the whole candidate patch against target at quxel, where
+    // target is either an image or one of its compact planes
+    template <int P, typename Target>
+    [[gnu::hot]] int patch_error(Target const& target, Coordinate quxel, Coordinate texel) const
     {
-        auto mask = multivec<u_char>(m_patch, m_patch, 1);
-
-        auto mask_seam = [&]<bool B>(Coordinate overlap) {
-            auto seam = find_seam<B>(quxel, texel, overlap);
+        auto const height = P ? P : std::min(m_patch, m_quilt.height() - quxel.y);
+        auto const width = P ? P : std::min(m_patch, m_quilt.width() - quxel.x);
 
-            if (seam.size())
-                for (auto&& pixel : seam) {
-                    auto max = B ? pixel.x : pixel.y;
+        auto error = 0u;
 
-                    for (auto i = 0; i <= max; i++) {
-                        if constexpr (B) {
-                            mask[i, pixel.y] = 0;
-                        } else {
-                            mask[pixel.x, i] = 0;
-                        }
-                    }
-                }
-        };
+        for (auto j = 0; j < height; j++) {
+            auto const quilt = quxel + Coordinate { 0, j };
+            auto const texture = texel + Coordinate { 0, j };
 
-        auto delta = max - quxel;
+            auto const accumulate = [&](auto const* a, auto const* b, int, int length) {
+                error += row_error<span_length<P>>(a, b, length);
+            };
 
-        if (quxel.x >= m_chunk)
-            mask_seam.template operator()<VERTICAL_SEAM>({ m_overlap, delta.y });
+            if constexpr (std::is_same_v<Target, Image>)
+                for_each_span(target, quilt, local_texture(), texture, width, accumulate);
+            else
+                for_each_span(target, quilt, local_texture_luminance(), texture, width, accumulate);
+        }
 
-        if (quxel.y >= m_chunk)
-            mask_seam.template operator()<HORIZONTAL_SEAM>({ delta.x, m_overlap });
+        return error;
+    }
 
-        return mask;
+    template <int P, int O>
+    static constexpr Kernels make_kernels()
+    {
+        return {
+            P, O,
+            &Quilt::overlap_error<P, O>,
+            &Quilt::patch_error<P, Image>,
+            &Quilt::overlap_error<P, O, true>,
+            &Quilt::patch_error<P, Plane>,
+            &Quilt::find_seam<VERTICAL_SEAM, O>,
+            &Quilt::find_seam<HORIZONTAL_SEAM, O>
+        };
     }
 
-    template <size_t flag>
-    [[gnu::hot]] void create_patch_at(Coordinate quxel, Coordinate max, int K)
+    // Picks the specialized kernels for the patch/overlap pair, or the generic
+    // ones if the pair was not listed in QUILT_KERNELS at build time
+    static Kernels const& select_kernels(int patch, int overlap)
     {
-        if constexpr (flag == Quilt::SYNTHESIS_RANDOM) {
-            auto copy_lock = std::unique_lock<std::mutex>(m_copy_mtx);
+#define KERNEL(P, O) make_kernels<P, O>(),
+        static constexpr Kernels table[] = { QUILT_KERNELS make_kernels<0, 0>() };
+#undef KERNEL
 
-            copy_patch(quxel, random_patch());
-        } else {
-            auto patch = random_overlapping_patch(quxel, K);
+        for (auto const& kernels : table)
+            if (kernels.patch == patch && kernels.overlap == overlap)
+                return kernels;
 
-            if constexpr (flag == Quilt::SYNTHESIS_SIMPLE) {
-                auto copy_lock = std::unique_lock<std::mutex>(m_copy_mtx);
+        return table[std::size(table) - 1];
+    }
 
-                copy_patch(quxel, patch);
-            }
+    auto overlap_kernel(Coordinate quxel) const
+    {
+        auto const& kernels = kernels_at(quxel);
 
-            if constexpr (flag == Quilt::SYNTHESIS_CUT) {
-                auto mask = find_mask(quxel, patch, max);
-                auto copy_lock = std::unique_lock<std::mutex>(m_copy_mtx);
+        return m_matching == MATCH_LUMINANCE ? kernels.luminance_overlap_error : kernels.overlap_error;
+    }
 
-                copy_patch(quxel, patch, mask);
+    // Specialized kernels only cover patches that fit inside the quilt
+    Kernels const& kernels_at(Coordinate quxel) const
+    {
+        if (quxel.x + m_patch > m_quilt.width() || quxel.y + m_patch > m_quilt.height())
+            return select_kernels(0, 0);
+
+        return *m_kernels;
+    }
+
+    // Keep the K lowest errors seen so far in a max-heap
+    static void offer_candidate(std::vector<SSD>& heap, int K, SSD const& candidate)
+    {
+        if (heap.size() < K || heap.front().ssd > candidate.ssd) {
+            if (heap.size() == K) {
+                std::pop_heap(heap.begin(), heap.end());
+                heap.pop_back();
             }
+
+            heap.push_back(candidate);
+            std::push_heap(heap.begin(), heap.end());
         }
     }
 
-    void add_patch(Coordinate patch)
+    static Coordinate pick_candidate(std::vector<SSD>& heap)
     {
-#if DBGLN
-        std::cout << "[MultiQueue] Enqueuing Q" << patch << '\n';
-#endif
-
-        {
-            auto lock = std::unique_lock<std::mutex>(m_queue_mtx);
-            m_queue.push(patch);
+        auto it = random(heap.size() - 1);
+        for (auto i = 0; i < it; i++) {
+            std::pop_heap(heap.begin(), heap.end());
+            heap.pop_back();
         }
 
-        m_queue_convar.notify_one();
+        return heap.front().coord;
     }
 
-    template <size_t flag>
-    void worker(int const K, bool seed_output = true)
+    // Offers the candidate texture offsets to the K best by score. Scans
+    // every stride-th offset along both axes when subsampling or on a budget.
+    // Subsampled scans then search densely within a stride of their best
+    // grid points, since neighbouring offsets have closely related errors.
+    // Candidates are kept by their address in view, see view_address().
+    template <typename Score>
+    [[gnu::always_inline]] void scan_candidates(Scratch& scratch, int K, Score&& score, int view = 0) const
     {
-        while (true) {
-            auto chunk = Coordinate {};
-
-            {
-                auto lock = std::unique_lock<std::mutex> { m_queue_mtx };
+        auto const stride = scratch.scan_stride;
+        auto const best = stride > 1 ? scratch.scan_refine : 0;
 
-                m_queue_convar.wait(lock, [this] -> bool {
-                    return !m_queue.empty() || m_completed;
-                });
+        auto& queue = scratch.candidates;
+        auto& coarse = scratch.coarse;
+        coarse.clear();
 
-                if (m_completed)
-                    return;
+        // One sweep over every exemplar, with grids aligned to each band
+        for (auto const& band : m_bands) {
+            auto const extent = band_candidates(band);
 
-                chunk = m_queue.front();
-                m_queue.pop();
-            }
+            for (auto x = 0; x < extent.x; x += stride)
+                for (auto y = band.y; y < band.y + extent.y; y += stride) {
+                    auto const ssd = score(Coordinate { x, y });
 
-            {
-                auto lock = std::unique_lock<std::mutex> { m_status_mtx };
+                    offer_candidate(queue, K, SSD { ssd, view_address({ x, y }, view) });
 
-                auto& status = m_status[chunk];
+                    if (best)
+                        offer_candidate(coarse, best, SSD { ssd, { x, y } });
+                }
 
-                // Avoid working on in-progress or completed patches
-                if (status != -1)
-                    continue;
+            scratch.scanned += static_cast<size_t>((extent.x + stride - 1) / stride) * ((extent.y + stride - 1) / stride);
+        }
 
-                status = 0;
-            }
+        for (auto i = 0; i < coarse.size(); i++) {
+            auto const center = coarse[i].coord;
+            auto const& band = band_at(center.y);
+            auto const extent = band_candidates(band);
 
-            auto const quxel = Coordinate {
-                chunk.x * m_chunk,
-                chunk.y * m_chunk
-            };
+            // Windows of earlier grid points already covered their overlap
+            auto const covered = [&](int x, int y) {
+                for (auto j = 0; j < i; j++)
+                    if (std::abs(coarse[j].coord.x - x) <= stride && std::abs(coarse[j].coord.y - y) <= stride && &band_at(coarse[j].coord.y) == &band)
+                        return true;
 
-            auto const boundary = Coordinate {
-                std::min(m_quilt.width() - 1, quxel.x + m_patch),
-                std::min(m_quilt.height() - 1, quxel.y + m_patch)
+                return false;
             };
 
-            if (seed_output && !(quxel.x || quxel.y)) {
-                auto copy_lock = std::unique_lock<std::mutex>(m_copy_mtx);
+            for (auto x = std::max(center.x - stride, 0); x <= std::min(center.x + stride, extent.x - 1); x++)
+                for (auto y = std::max(center.y - stride, band.y); y <= std::min(center.y + stride, band.y + extent.y - 1); y++) {
+                    if ((x % stride == 0 && (y - band.y) % stride == 0) || covered(x, y))
+                        continue;
 
-                copy_patch(quxel, random_patch());
-            } else {
-                create_patch_at<flag>(quxel, boundary, K);
-            }
+                    offer_candidate(queue, K, SSD { score(Coordinate { x, y }), view_address({ x, y }, view) });
+                    scratch.scanned++;
+                }
+        }
+    }
 
-            {
-                auto lock = std::unique_lock<std::mutex>(m_status_mtx);
+    [[gnu::flatten]] virtual Coordinate random_overlapping_patch(Coordinate const& quxel, int K, Scratch& scratch) const
+    {
+        auto const top_overlap = quxel.y >= m_chunk;
+        auto const left_overlap = quxel.x >= m_chunk;
+        auto const right_overlap = kept_neighbour(quxel, { 1, 0 });
+        auto const bottom_overlap = kept_neighbour(quxel, { 0, 1 });
+        auto const overlap_error = overlap_kernel(quxel);
 
-                m_status[chunk] = 1;
-                m_total_completed++;
-            }
+        auto& queue = scratch.candidates;
+        queue.clear();
 
-#if DBGLN
-            std::cout << "[MultiQueue] Finished Q" << chunk << " progress: " << m_total_completed << '/' << m_status.size() << '\n';
-#endif
+        if (m_views & VIEWS_ORIGINAL)
+            scan_candidates(scratch, K, [&](Coordinate patch) {
+                auto ssd = (this->*overlap_error)(quxel, patch, left_overlap, top_overlap);
 
-            if (chunk.x < m_max_chunk_x - 1) {
-                auto top_right = chunk + Coordinate { 1, -1 };
+                if (right_overlap || bottom_overlap)
+                    ssd += border_error(quxel, patch, right_overlap, bottom_overlap);
 
-                if (is_patch_complete(top_right))
-                    add_patch(chunk + Coordinate { 1, 0 });
-            }
+                return ssd;
+            });
 
-            if (chunk.y < m_max_chunk_y - 1) {
-                auto bottom_left = chunk + Coordinate { -1, 1 };
+        if (m_views != VIEWS_ORIGINAL) {
+            cover_overlaps(quxel, left_overlap, top_overlap, right_overlap, bottom_overlap, scratch);
 
-                if (is_patch_complete(bottom_left))
-                    add_patch(chunk + Coordinate { 0, 1 });
-            }
+            for (auto view = 1; view < VIEWS; view++) {
+                if (!(m_views >> view & 1))
+                    continue;
 
-            if (!chunk.x && chunk.y < m_max_chunk_y - 1) {
-                // Chunk along left edge, and not at bottom edge
-                add_patch(chunk + Coordinate { 0, 1 });
-            }
+                prepare_view(quxel, view, scratch);
 
-            if (!chunk.y && chunk.x < m_max_chunk_x - 1) {
-                // Chunk along top edge, and not at right edge
-                add_patch(chunk + Coordinate { 1, 0 });
+                if (m_matching == MATCH_LUMINANCE)
+                    scan_candidates(scratch, K, [&](Coordinate patch) { return view_error<true>(patch, scratch); }, view);
+                else
+                    scan_candidates(scratch, K, [&](Coordinate patch) { return view_error<false>(patch, scratch); }, view);
             }
         }
+
+        auto const match = pick_candidate(queue);
+
+#ifdef DBGLN
+        std::cout << "Match [badness: " << queue.front().ssd << "] Texture" << match << " -> Quilt" << quxel << '\n';
+#endif
+
+        return match;
     }
 
-    void synthesize(int patch_sz, int overlap_sz, int K, int flag = SYNTHESIS_CUT)
+    // Marks the pixels of the patch at quxel that candidates are compared on
+    void cover_overlaps(Coordinate quxel, bool left, bool top, bool right, bool bottom, Scratch& scratch) const
     {
-        assert(patch_sz > overlap_sz);
+        auto const height = std::min(m_patch, m_quilt.height() - quxel.y);
+        auto const width = std::min(m_patch, m_quilt.width() - quxel.x);
 
-        m_patch = patch_sz;
-        m_overlap = overlap_sz;
-        m_chunk = patch_sz - overlap_sz;
+        std::fill(scratch.covered.begin(), scratch.covered.end(), 0);
 
-        m_max_chunk_y = (m_quilt.height() / m_chunk) + (m_quilt.height() % m_chunk != 0);
-        m_max_chunk_x = (m_quilt.width() / m_chunk) + (m_quilt.width() % m_chunk != 0);
+        for (auto j = 0; j < height; j++)
+            for (auto i = 0; i < width; i++)
+                scratch.covered[j * m_patch + i] = (top && j < m_overlap) || (left && i < m_overlap)
+                    || (right && i >= m_chunk) || (bottom && j >= m_chunk);
+    }
 
-        m_status = decltype(m_status)(m_max_chunk_x, m_max_chunk_y, -1);
+    // Lays the covered pixels and their quilt values out as view sees them
+    void prepare_view(Coordinate quxel, int view, Scratch& scratch) const
+    {
+        auto& mask = scratch.view_mask;
+        mask.clear();
 
-        auto const max_threads = std::thread::hardware_concurrency();
-        m_pool = decltype(m_pool) {};
+        for (auto y = 0; y < m_patch; y++) {
+            auto run = 0;
 
-        for (auto i = 0; i < max_threads; i++) {
-            m_pool.push_back(std::thread([this, flag, K] -> void {
-                switch (flag) {
-                case Quilt::SYNTHESIS_RANDOM:
-                    return this->worker<Quilt::SYNTHESIS_RANDOM>(K);
+            for (auto x = 0; x <= m_patch; x++) {
+                auto covered = false;
 
-                case Quilt::SYNTHESIS_SIMPLE:
-                    return this->worker<Quilt::SYNTHESIS_SIMPLE>(K);
+                if (x < m_patch) {
+                    auto const u = view & 1 ? m_patch - 1 - x : x;
+                    auto const v = view & 2 ? m_patch - 1 - y : y;
+                    auto const pixel = view & 4 ? Coordinate { v, u } : Coordinate { u, v };
 
-                default:
-                    return this->worker<Quilt::SYNTHESIS_CUT>(K);
+                    covered = scratch.covered[pixel.y * m_patch + pixel.x];
+
+                    if (covered) {
+                        if (m_matching == MATCH_LUMINANCE)
+                            scratch.view_target_luminance[x, y] = m_quilt_luminance[quxel + pixel];
+                        else
+                            scratch.view_target[x, y] = m_quilt[quxel + pixel];
+                    }
                 }
-            }));
-        }
 
-        while (is_busy()) { };
+                if (!covered) {
+                    mask.add(run, x);
+                    run = x + 1;
+                }
+            }
 
-        cleanup();
+            mask.end_row();
+        }
     }
 
-    bool is_patch_complete(Coordinate patch)
+    // Error of the candidate covering the texture square at texel against
+    // the view laid out by prepare_view()
+    template <bool luminance>
+    [[gnu::hot]] int view_error(Coordinate texel, Scratch const& scratch) const
     {
-        auto status = false;
+        auto const& mask = scratch.view_mask;
+        auto error = 0u;
 
-        {
-            auto lock = std::unique_lock<std::mutex>(m_status_mtx);
-            status = m_status[patch] == 1;
-        }
+        auto const accumulate = [&](auto const* a, auto const* b, int, int length) {
+            error += row_error(a, b, length);
+        };
 
-        return status;
+        for (auto j = 0; j < mask.height(); j++)
+            for (auto span = mask.begin(j); span != mask.end(j); span++) {
+                auto const offset = Coordinate { span->start, j };
+
+                if constexpr (luminance)
+                    for_each_span(scratch.view_target_luminance, offset, local_texture_luminance(), texel + offset, span->end - span->start, accumulate);
+                else
+                    for_each_span(scratch.view_target, offset, local_texture(), texel + offset, span->end - span->start, accumulate);
+            }
+
+        return error;
     }
 
-    bool is_busy()
+    // overlap_error() in RGBA of a candidate in a transformed view, a pixel
+    // at a time, for recording the patches chosen
+    int view_overlap_error(Coordinate quxel, Coordinate address, bool left, bool top) const
     {
-        auto busy = false;
+        auto const height = std::min(m_patch, m_quilt.height() - quxel.y);
+        auto const width = std::min(m_patch, m_quilt.width() - quxel.x);
+        auto const rows = top ? std::min(m_overlap, height) : 0;
+        auto const columns = left ? std::min(m_overlap, width) : 0;
 
-        {
-            auto lock = std::unique_lock<std::mutex>(m_status_mtx);
+        auto error = 0u;
 
-            busy = m_total_completed < m_status.size();
-        }
+        for (auto j = 0; j < height; j++)
+            for (auto i = 0; i < (j < rows ? width : columns); i++) {
+                auto const offset = Coordinate { i, j };
 
-        return busy;
+                error += squared_difference(m_quilt[quxel + offset], local_texture()[view_texel(address + offset)]);
+            }
+
+        return error;
     }
 
-    void cleanup()
+    // Minimum-error boundary cut through the overlap region at quxel. The
+    // returned cut holds, for every step along the seam, the last overlap
+    // index that keeps the existing quilt pixel: a column per row for
+    // vertical seams and a row per column for horizontal seams.
+    template <bool vertical_seam, int O = 0>
+    [[gnu::flatten]] std::vector<int> const& find_seam(
+        Coordinate quxel,
+        Coordinate texel,
+        Coordinate overlap,
+        Scratch& scratch) const
     {
-        {
-            auto lock = std::unique_lock<std::mutex>(m_queue_mtx);
-            m_completed = true;
+        // O fixes the overlap width, i.e. the number of lanes, at compile time
+        auto const width = vertical_seam && O ? O : std::min(overlap.x, m_quilt.width() - quxel.x);
+        auto const height = !vertical_seam && O ? O : std::min(overlap.y, m_quilt.height() - quxel.y);
+
+        // The DP walks along the seam with vector lanes across the overlap
+        auto const steps = vertical_seam ? height : width;
+        auto const lanes = vertical_seam ? width : height;
+
+        auto& cut = vertical_seam ? scratch.vertical_cut : scratch.horizontal_cut;
+        cut.clear();
+
+        if (steps <= 0 || lanes <= 0)
+            return cut;
+
+        // Every DP row lives at [1, lanes] of a stride-wide row, so the three
+        // predecessors of lane j are the unaligned loads at j, j + 1 and j + 2
+        auto const stride = Scratch::stride(lanes);
+
+        auto* const energy = scratch.energy.data();
+        auto* const cost = scratch.cost.data();
+        auto* const path = scratch.path.data();
+
+        for (auto y = 0; y < height; y++) {
+            auto* const row = vertical_seam ? energy + y * stride + 1 : scratch.row.data();
+            auto const offset = Coordinate { 0, y };
+
+            if (texel.x >= m_view_stride)
+                for (auto x = 0; x < width; x++)
+                    row[x] = squared_difference(m_quilt[quxel + offset + Coordinate { x, 0 }], local_texture()[view_texel(texel + offset + Coordinate { x, 0 })]);
+            else
+                for_each_span(m_quilt, quxel + offset, local_texture(), texel + offset, width, [&](RGBA const* quilt, RGBA const* texture, int x, int n) {
+                    squared_difference(quilt, texture, n, row + x);
+                });
+
+            if constexpr (!vertical_seam)
+                for (auto x = 0; x < width; x++)
+                    energy[x * stride + y + 1] = row[x];
         }
 
-        m_queue_convar.notify_all();
+        // Energies square the summed channel difference, so they are at
+        // most 765^2 = 585225 and 32-bit costs hold seams of about 7300
+        // steps, far beyond any practical patch size
+        constexpr auto sentinel = std::numeric_limits<uint32_t>::max();
+        auto const iota = i32x8 { 0, 1, 2, 3, 4, 5, 6, 7 };
 
-        for (auto&& thread : m_pool)
-            thread.join();
+        std::fill(cost, cost + stride, sentinel);
+        std::copy(energy + 1, energy + 1 + lanes, cost + 1);
 
-        m_pool.clear();
-    }
+        for (auto i = 1; i < steps; i++) {
+            auto const* const prev = cost + (i - 1) * stride;
+            auto* const row = cost + i * stride;
 
-    void write(std::string const& filename) const { m_quilt.write(filename); }
+            for (auto j = 0; j < lanes; j += 8) {
+                auto left = u32x8 {}, right = u32x8 {}, minimum = u32x8 {}, step = u32x8 {};
+                load(left, prev + j);
+                load(right, prev + j + 2);
+                load(step, energy + i * stride + j + 1);
+
+                // Ties prefer the pixel straight above, then the left one
+                load(minimum, prev + j + 1);
+
+                auto const index = iota + j;
+                auto from = index;
+
+                auto const left_less = left < minimum;
+                minimum = left_less ? left : minimum;
+                from = left_less ? index - 1 : from;
+
+                auto const right_less = right < minimum;
+                minimum = right_less ? right : minimum;
+                from = right_less ? index + 1 : from;
+
+                store(row + j + 1, minimum + step);
+                store(path + i * stride + j, from);
+            }
+
+            // Restore the sentinels clobbered by the padding lanes
+            row[0] = sentinel;
+            std::fill(row + lanes + 1, row + stride, sentinel);
+        }
+
+        auto const* const last_row = cost + (steps - 1) * stride + 1;
+        auto j = static_cast<int>(std::distance(last_row, std::min_element(last_row, last_row + lanes)));
+
+        scratch.seam_energy += last_row[j];
+
+        cut.resize(steps);
+
+        for (auto i = steps; i-- > 0;) {
+            cut[i] = j;
+            j = path[i * stride + j];
+        }
+
+        return cut;
+    }
+
+    [[gnu::flatten, gnu::hot]] Mask const& find_mask(Coordinate quxel, Coordinate texel, Coordinate max, Scratch& scratch) const
+    {
+        auto const height = std::min(m_quilt.height() - quxel.y, m_patch);
+        auto const width = std::min(m_quilt.width() - quxel.x, m_patch);
+        auto const delta = max - quxel;
+
+        auto& mask = scratch.mask;
+        mask.clear();
+
+        auto const& vertical = scratch.vertical_cut;
+        auto const& horizontal = scratch.horizontal_cut;
+        auto& right = scratch.right_cut;
+        auto& bottom = scratch.bottom_cut;
+
+        auto const& kernels = kernels_at(quxel);
+
+        // Seams into kept pixels right of and below the patch share the
+        // buffers of the left and top ones, so they are cut first and saved.
+        // Those cuts hold the first overlap index that keeps the quilt pixel.
+        right.clear();
+        bottom.clear();
+
+        if (kept_neighbour(quxel, { 1, 0 }) && width > m_chunk) {
+            auto const& cut = (this->*kernels.vertical_seam)(quxel + Coordinate { m_chunk, 0 }, texel + Coordinate { m_chunk, 0 }, { m_overlap, delta.y }, scratch);
+            right.assign(cut.begin(), cut.end());
+        }
+
+        if (kept_neighbour(quxel, { 0, 1 }) && height > m_chunk) {
+            auto const& cut = (this->*kernels.horizontal_seam)(quxel + Coordinate { 0, m_chunk }, texel + Coordinate { 0, m_chunk }, { delta.x, m_overlap }, scratch);
+            bottom.assign(cut.begin(), cut.end());
+        }
+
+        if (quxel.x >= m_chunk)
+            (this->*kernels.vertical_seam)(quxel, texel, { m_overlap, delta.y }, scratch);
+        else
+            scratch.vertical_cut.clear();
+
+        if (quxel.y >= m_chunk)
+            (this->*kernels.horizontal_seam)(quxel, texel, { delta.x, m_overlap }, scratch);
+        else
+            scratch.horizontal_cut.clear();
+
+        for (auto j = 0; j < height; j++) {
+            auto const start = j < vertical.size() ? vertical[j] + 1 : 0;
+            auto const end = j < right.size() ? m_chunk + right[j] : width;
+
+            auto const top_strip = j < m_overlap && !horizontal.empty();
+            auto const bottom_strip = j >= m_chunk && !bottom.empty();
+
+            if (!top_strip && !bottom_strip) {
+                mask.add(start, end);
+            } else {
+                // Split the row wherever the horizontal seam passes below it,
+                // or the bottom seam above it
+                auto run = start;
+
+                for (auto i = start; i < end; i++) {
+                    auto const keep = (top_strip && i < horizontal.size() && horizontal[i] >= j)
+                        || (bottom_strip && i < bottom.size() && bottom[i] <= j - m_chunk);
+
+                    if (keep) {
+                        mask.add(run, i);
+                        run = i + 1;
+                    }
+                }
+
+                mask.add(run, end);
+            }
+
+            mask.end_row();
+        }
+
+        return mask;
+    }
+
+    // Lets subclasses wait for inputs that the chunk at quxel reads and that
+    // may still be loading
+    virtual void await_inputs(Coordinate) { }
+
+    // Lets subclasses fill a chunk from earlier results instead of searching.
+    // Implementations must set m_offsets[chunk] when returning true.
+    virtual bool reuse_chunk(Coordinate chunk, Coordinate quxel) { return false; }
+
+    // Copies the pixels of source in [min, max) to the same place in the quilt
+    void copy_region(Image const& source, Coordinate min, Coordinate max)
+    {
+        auto copy_lock = std::unique_lock<std::mutex>(m_copy_mtx);
+
+        for (auto y = min.y; y < max.y; y++) {
+            auto const row = Coordinate { min.x, y };
+
+            for_each_span(m_quilt, row, source, row, max.x - min.x, [](RGBA* to, RGBA const* from, int, int n) {
+                memcpy(to, from, n * sizeof(RGBA));
+            });
+
+            if (m_matching == MATCH_LUMINANCE)
+                for (auto x = min.x; x < max.x; x++)
+                    m_quilt_luminance[x, y] = Image::luminance(source[x, y]);
+        }
+
+        m_copies++;
+    }
+
+    // Waits for and copies in the boundary columns of the shard above
+    void import_boundary(Coordinate chunk)
+    {
+        if (!m_segment || !m_shard || chunk.y != m_segment->first_row(m_shard))
+            return;
+
+        auto const top = chunk.y * m_chunk;
+        auto const rows = std::min(m_overlap, m_quilt.height() - top);
+        auto const start = chunk.x ? chunk.x * m_chunk + m_overlap : 0;
+        auto const end = std::min(chunk.x * m_chunk + m_patch, m_quilt.width());
+        auto const* const strip = m_segment->strip(m_shard);
+
+        // The patch may reach past the chunk to its right
+        m_segment->wait(m_shard, std::min<int>((end - 1) / m_chunk, m_max_chunk_x - 1));
+
+        auto copy_lock = std::unique_lock<std::mutex>(m_copy_mtx);
+
+        for (auto j = 0; j < rows; j++)
+            for (auto x = start; x < end; x++) {
+                auto const pixel = strip[j * m_quilt.width() + x];
+
+                m_quilt[x, top + j] = pixel;
+
+                if (m_matching == MATCH_LUMINANCE)
+                    m_quilt_luminance[x, top + j] = Image::luminance(pixel);
+            }
+    }
+
+    // Publishes the boundary columns below a finished chunk of the last row
+    void export_boundary(Coordinate chunk)
+    {
+        if (!m_segment || m_shard + 1 == m_segment->shards() || chunk.y + 1 != m_segment->first_row(m_shard + 1))
+            return;
+
+        auto const top = (chunk.y + 1) * m_chunk;
+        auto const rows = std::min(m_overlap, m_quilt.height() - top);
+        auto const start = chunk.x * m_chunk;
+        auto const end = chunk.x + 1 == m_max_chunk_x ? m_quilt.width() : std::min(start + m_chunk, m_quilt.width());
+        auto* const strip = m_segment->strip(m_shard + 1);
+
+        {
+            auto copy_lock = std::unique_lock<std::mutex>(m_copy_mtx);
+
+            for (auto j = 0; j < rows; j++)
+                for (auto x = start; x < end; x++)
+                    strip[j * m_quilt.width() + x] = m_quilt[x, top + j];
+        }
+
+        m_segment->publish(m_shard + 1, chunk.x);
+    }
+
+    // Runs one shard of synthesize_sharded() in a forked process
+    void synthesize_shard(ShardSegment& segment, int shard, int K, int flag)
+    {
+        auto const start = std::chrono::steady_clock::now();
+        auto const first = segment.first_row(shard);
+        auto const last = segment.first_row(shard + 1);
+
+        m_segment = &segment;
+        m_shard = shard;
+
+        start_budget();
+        layout_chunks();
+        prepare_planes();
+
+        for (auto j = 0; j < m_max_chunk_y; j++)
+            for (auto i = 0; i < m_max_chunk_x; i++)
+                if (j < first || j >= last) {
+                    m_status[i, j] = 1;
+                    m_total_completed++;
+                }
+
+        m_queue = decltype(m_queue) {};
+        m_queue.push({ 0, first });
+
+        run_workers(K, flag, true);
+
+        for (auto y = first * m_chunk; y < std::min<int>(last * m_chunk, m_quilt.height()); y++)
+            for (auto x = 0; x < m_quilt.width(); x++)
+                segment.output()[static_cast<size_t>(y) * m_quilt.width() + x] = m_quilt[x, y];
+
+        auto& statistics = segment.statistics(shard);
+        statistics.overlap_error = m_overlap_error;
+        statistics.overlap_pixels = m_overlap_pixels;
+        statistics.seam_energy = m_seam_energy;
+        statistics.scanned = m_scanned;
+        statistics.scan_time = m_scan_time;
+        statistics.chunk_time = m_chunk_time;
+        statistics.chunk_overhead = m_chunk_overhead;
+        statistics.chunks_timed = m_chunks_timed;
+        statistics.budget_fallbacks = m_budget_fallbacks;
+
+#ifdef BENCHMARK
+        statistics.match_time = m_match_time;
+        statistics.seam_time = m_seam_time;
+        statistics.chunk_allocations = m_chunk_allocations;
+#endif
+
+        std::cout << "[Shard] " << shard << ": chunk rows " << first << '-' << last - 1 << " in "
+                  << std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() << "s\n"
+                  << std::flush;
+    }
+
+    // Sampling stride of the candidate scan for the next chunk, or 0 once the
+    // budget only leaves time to fill the remaining chunks with random
+    // patches. Spreads the time left evenly over the remaining chunks at the
+    // scan rate the workers have measured so far.
+    int scan_stride()
+    {
+        if (!m_deadline)
+            return 1;
+
+        auto remaining = size_t {};
+
+        {
+            auto lock = std::unique_lock<std::mutex>(m_status_mtx);
+            remaining = m_status.size() - m_total_completed;
+        }
+
+        // Set aside what the remaining chunks take besides scanning, at
+        // least 20us each for a random fill
+        auto const chunks = m_chunks_timed.load();
+        auto const overhead = chunks ? m_chunk_overhead * 1e-9 / chunks : 0.;
+        auto const left = std::chrono::duration<double>(*m_deadline - std::chrono::steady_clock::now()).count()
+            - remaining * std::max(overhead, 20e-6) / m_threads;
+
+        if (left <= 0)
+            return 0;
+
+        auto const scanned = m_scanned.load();
+        auto const scan_time = m_scan_time.load();
+
+        // Measure the rate on a sparse scan first
+        if (!scanned || !scan_time)
+            return 8;
+
+        // Plan on 80% of the time left, scan rates vary from chunk to chunk
+        auto const rate = scanned / (scan_time * 1e-9);
+        auto const affordable = std::max(.8 * rate * left * m_threads / remaining, 1.);
+        auto const candidates = static_cast<double>(candidate_count()) * std::popcount(static_cast<unsigned>(m_views));
+
+        return std::max(1, static_cast<int>(std::ceil(std::sqrt(candidates / affordable))));
+    }
+
+    // Records the overlap error of patch at quxel for mean_overlap_error(),
+    // always in RGBA so that the matchers can be compared by it
+    void record_overlap(Coordinate quxel, Coordinate patch)
+    {
+        auto const top = quxel.y >= m_chunk;
+        auto const left = quxel.x >= m_chunk;
+
+        if (!top && !left)
+            return;
+
+        auto const height = std::min(m_patch, m_quilt.height() - quxel.y);
+        auto const width = std::min(m_patch, m_quilt.width() - quxel.x);
+        auto const rows = top ? std::min(m_overlap, height) : 0;
+        auto const columns = left ? std::min(m_overlap, width) : 0;
+
+        m_overlap_error += patch.x >= m_view_stride ? view_overlap_error(quxel, patch, left, top)
+                                                    : (this->*kernels_at(quxel).overlap_error)(quxel, patch, left, top);
+        m_overlap_pixels += rows * width + (height - rows) * columns;
+    }
+
+    // Fills the chunk at quxel and returns the texture offset it was taken from
+    template <size_t flag>
+    [[gnu::hot]] Coordinate create_patch_at(Coordinate quxel, Coordinate max, int K, Scratch& scratch)
+    {
+        auto const start = std::chrono::steady_clock::now();
+        auto const stride = flag == Quilt::SYNTHESIS_RANDOM ? 1 : scan_stride();
+
+        auto patch = Coordinate {};
+        scratch.scan_time = 0;
+
+        if (flag == Quilt::SYNTHESIS_RANDOM || !stride) {
+            patch = random_patch();
+
+            if (flag != Quilt::SYNTHESIS_RANDOM) {
+                m_budget_fallbacks++;
+                record_overlap(quxel, patch);
+            }
+
+            auto copy_lock = std::unique_lock<std::mutex>(m_copy_mtx);
+
+            copy_patch(quxel, patch);
+        } else {
+            scratch.scan_stride = std::max(stride, m_subsample_stride);
+            scratch.scan_refine = m_subsample_best;
+            scratch.scanned = 0;
+
+            {
+#ifdef BENCHMARK
+                auto const timer = ScopedTimer { m_match_time };
+#endif
+                auto const scan_start = std::chrono::steady_clock::now();
+
+                patch = random_overlapping_patch(quxel, K, scratch);
+
+                scratch.scan_time = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - scan_start).count();
+            }
+
+            m_scan_time += scratch.scan_time;
+            m_scanned += scratch.scanned;
+            record_overlap(quxel, patch);
+
+            if constexpr (flag == Quilt::SYNTHESIS_SIMPLE) {
+                auto copy_lock = std::unique_lock<std::mutex>(m_copy_mtx);
+
+                copy_patch(quxel, patch);
+            }
+
+            if constexpr (flag == Quilt::SYNTHESIS_CUT) {
+#ifdef BENCHMARK
+                auto timer = std::optional<ScopedTimer>(std::in_place, m_seam_time);
+#endif
+
+                scratch.seam_energy = 0;
+
+                auto const& mask = find_mask(quxel, patch, max, scratch);
+
+#ifdef BENCHMARK
+                timer.reset();
+#endif
+
+                m_seam_energy += scratch.seam_energy;
+
+                auto copy_lock = std::unique_lock<std::mutex>(m_copy_mtx);
+
+                copy_patch(quxel, patch, mask);
+            }
+        }
+
+        // What the chunk took besides scanning is only counted once it is
+        // done, together with the chunk itself, so that scan_stride() never
+        // sees the scan time of a chunk without the rest of it
+        auto const elapsed = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count());
+
+        m_chunk_time += elapsed;
+        m_chunk_overhead += elapsed - std::min(scratch.scan_time, elapsed);
+        m_chunks_timed++;
+
+        return patch;
+    }
+
+    void add_patch(Coordinate patch)
+    {
+#if DBGLN
+        std::cout << "[MultiQueue] Enqueuing Q" << patch << '\n';
+#endif
+
+        {
+            auto lock = std::unique_lock<std::mutex>(m_queue_mtx);
+            m_queue.push(patch);
+        }
+
+        m_queue_convar.notify_one();
+    }
+
+    template <size_t flag>
+    void worker(int const K, bool seed_output = true)
+    {
+        auto scratch = Scratch {};
+        scratch.reserve(m_patch, m_overlap, K, m_views != VIEWS_ORIGINAL);
+
+        while (true) {
+            auto chunk = Coordinate {};
+
+            {
+                auto lock = std::unique_lock<std::mutex> { m_queue_mtx };
+
+                m_queue_convar.wait(lock, [this] -> bool {
+                    return !m_queue.empty() || m_completed;
+                });
+
+                if (m_completed)
+                    return;
+
+                chunk = m_queue.front();
+                m_queue.pop();
+            }
+
+            {
+                auto lock = std::unique_lock<std::mutex> { m_status_mtx };
+
+                auto& status = m_status[chunk];
+
+                // Avoid working on in-progress or completed patches
+                if (status != -1)
+                    continue;
+
+                status = 0;
+            }
+
+            auto const quxel = Coordinate {
+                chunk.x * m_chunk,
+                chunk.y * m_chunk
+            };
+
+            if (m_seed)
+                seed_random(*m_seed, flag, m_patch, chunk.x, chunk.y);
+
+            await_inputs(quxel);
+            import_boundary(chunk);
+
+            auto const boundary = Coordinate {
+                std::min(m_quilt.width() - 1, quxel.x + m_patch),
+                std::min(m_quilt.height() - 1, quxel.y + m_patch)
+            };
+
+            if (seed_output && !(quxel.x || quxel.y)) {
+                auto const patch = random_patch();
+                auto copy_lock = std::unique_lock<std::mutex>(m_copy_mtx);
+
+                copy_patch(quxel, patch);
+                m_offsets[chunk] = patch;
+            } else if (reuse_chunk(chunk, quxel)) {
+                // Filled from earlier results without a search
+            } else {
+#ifdef BENCHMARK
+                auto const allocations = g_allocations;
+#endif
+
+                m_offsets[chunk] = create_patch_at<flag>(quxel, boundary, K, scratch);
+
+#ifdef BENCHMARK
+                m_chunk_allocations += g_allocations - allocations;
+#endif
+            }
+
+            export_boundary(chunk);
+
+            {
+                auto lock = std::unique_lock<std::mutex>(m_status_mtx);
+
+                m_status[chunk] = 1;
+                m_total_completed++;
+                m_marked++;
+
+                if (!m_first_chunk)
+                    m_first_chunk = std::chrono::steady_clock::now();
+            }
+
+#if DBGLN
+            std::cout << "[MultiQueue] Finished Q" << chunk << " progress: " << m_total_completed << '/' << m_status.size() << '\n';
+#endif
+
+            // The chunks right, below and below-left of this one may have
+            // been waiting on it
+            for (auto next : { chunk + Coordinate { 1, 0 }, chunk + Coordinate { 0, 1 }, chunk + Coordinate { -1, 1 } })
+                if (is_chunk_ready(next))
+                    add_patch(next);
+        }
+    }
+
+    // Sets up the chunk grid for the current patch and overlap sizes with
+    // every chunk still to do
+    void layout_chunks()
+    {
+        m_chunk = m_patch - m_overlap;
+
+        m_max_chunk_y = (m_quilt.height() / m_chunk) + (m_quilt.height() % m_chunk != 0);
+        m_max_chunk_x = (m_quilt.width() / m_chunk) + (m_quilt.width() % m_chunk != 0);
+
+        m_status = decltype(m_status)(m_max_chunk_x, m_max_chunk_y, -1);
+        m_offsets = decltype(m_offsets)(m_max_chunk_x, m_max_chunk_y, Coordinate {});
+        m_kernels = &select_kernels(m_patch, m_overlap);
+        m_completed = false;
+        m_total_completed = 0;
+        m_copies = 0;
+        m_marked = 0;
+
+        m_scan_time = 0;
+        m_scanned = 0;
+        m_chunk_time = 0;
+        m_chunk_overhead = 0;
+        m_chunks_timed = 0;
+        m_budget_fallbacks = 0;
+        m_overlap_error = 0;
+        m_overlap_pixels = 0;
+        m_seam_energy = 0;
+    }
+
+    // Starts the clock on the time budget, if there is one
+    void start_budget()
+    {
+        if (m_budget)
+            m_deadline = std::chrono::steady_clock::now() + *m_budget;
+    }
+
+    // Works through the queued chunks on every core until all are complete,
+    // calling idle() from this thread while waiting
+    template <typename Idle>
+    void run_workers(int K, int flag, bool seed_output, Idle&& idle)
+    {
+        auto const& topology = Topology::get();
+        auto const max_threads = m_worker_threads ? m_worker_threads : topology.workers();
+        m_pool = decltype(m_pool) {};
+        m_threads = max_threads;
+
+        prepare_replicas();
+
+        for (auto i = 0; i < max_threads; i++) {
+            auto const cpu = topology.cpus()[(m_cpu_offset + i) % topology.cpus().size()];
+
+            m_pool.push_back(std::thread([this, flag, K, seed_output, cpu] -> void {
+                if (m_pin || m_replicas.size()) {
+                    Topology::pin(cpu);
+
+                    if (m_replicas.size()) {
+                        auto const& replica = m_replicas[Topology::get().node(cpu)];
+
+                        t_texture = &replica.texture;
+                        t_texture_luminance = &replica.luminance;
+                    }
+                }
+
+                switch (flag) {
+                case Quilt::SYNTHESIS_RANDOM:
+                    return this->worker<Quilt::SYNTHESIS_RANDOM>(K, seed_output);
+
+                case Quilt::SYNTHESIS_SIMPLE:
+                    return this->worker<Quilt::SYNTHESIS_SIMPLE>(K, seed_output);
+
+                default:
+                    return this->worker<Quilt::SYNTHESIS_CUT>(K, seed_output);
+                }
+            }));
+        }
+
+        while (is_busy()) {
+            idle();
+            checkpoint_if_due();
+        }
+
+        cleanup();
+    }
+
+    // Copies the texture and its plane to every NUMA node that has allowed
+    // CPUs, if replicas are enabled and there is more than one node
+    void prepare_replicas()
+    {
+        auto const& topology = Topology::get();
+
+        if (!m_replicate || topology.nodes() < 2)
+            return;
+
+        // The luminance plane may have been made since the last pass
+        if (m_replicas.size() && m_replicas[topology.node(topology.cpus().front())].luminance.size() == m_texture_luminance.size())
+            return;
+
+        m_replicas = decltype(m_replicas)(topology.nodes());
+
+        for (auto node = 0; node < topology.nodes(); node++) {
+            auto const cpu = std::find_if(topology.cpus().begin(), topology.cpus().end(), [&](int cpu) {
+                return topology.node(cpu) == node;
+            });
+
+            if (cpu == topology.cpus().end())
+                continue;
+
+            std::thread([this, node, cpu = *cpu] {
+                Topology::pin(cpu);
+
+                m_replicas[node].texture = m_texture;
+                m_replicas[node].luminance = m_texture_luminance;
+            }).join();
+        }
+    }
+
+    void run_workers(int K, int flag, bool seed_output)
+    {
+        run_workers(K, flag, seed_output, [] { });
+    }
+
+    void synthesize(int patch_sz, int overlap_sz, int K, int flag = SYNTHESIS_CUT)
+    {
+        assert(patch_sz > overlap_sz);
+
+        m_patch = patch_sz;
+        m_overlap = overlap_sz;
+
+        start_budget();
+        layout_chunks();
+        prepare_planes();
+        restore_checkpoint();
+
+        run_workers(K, flag, true);
+        finish_checkpoints();
+    }
+
+    // synthesize() with the chunk rows split among forked processes, see
+    // ShardSegment. Seeded runs make the same quilt as synthesize().
+    void synthesize_sharded(int shards, int patch_sz, int overlap_sz, int K, int flag = SYNTHESIS_CUT)
+    {
+        assert(patch_sz > overlap_sz);
+
+        m_patch = patch_sz;
+        m_overlap = overlap_sz;
+
+        layout_chunks();
+
+        shards = std::clamp<int>(shards, 1, m_max_chunk_y);
+
+        auto segment = ShardSegment(shards, m_max_chunk_y, m_max_chunk_x, m_quilt.width(), m_quilt.height(), m_overlap);
+        auto const threads = m_worker_threads ? m_worker_threads : std::max(Topology::get().workers() / shards, 1u);
+        auto processes = std::vector<pid_t> {};
+
+        // Forked shards exit without flushing what was buffered before
+        std::cout.flush();
+        std::cerr.flush();
+
+        for (auto shard = 0; shard < shards; shard++) {
+            auto const pid = fork();
+
+            if (pid < 0) {
+                for (auto process : processes) {
+                    kill(process, SIGKILL);
+                    waitpid(process, nullptr, 0);
+                }
+
+                throw std::runtime_error("Cannot fork shard " + std::to_string(shard) + ".");
+            }
+
+            if (!pid) {
+                auto status = 0;
+
+                try {
+                    m_worker_threads = threads;
+                    m_cpu_offset = shard * threads;
+
+                    synthesize_shard(segment, shard, K, flag);
+                } catch (std::exception const& error) {
+                    std::cerr << "[Shard] " << shard << ": " << error.what() << '\n';
+                    status = 1;
+                }
+
+                _exit(status);
+            }
+
+            processes.push_back(pid);
+        }
+
+        // A shard that dies leaves the ones below it waiting forever
+        auto failed = -1;
+
+        for (auto remaining = shards; remaining;) {
+            auto status = 0;
+            auto const pid = waitpid(-1, &status, 0);
+
+            if (pid < 0)
+                break;
+
+            auto const shard = std::find(processes.begin(), processes.end(), pid);
+
+            if (shard == processes.end())
+                continue;
+
+            *shard = 0;
+            remaining--;
+
+            if (failed < 0 && (!WIFEXITED(status) || WEXITSTATUS(status))) {
+                failed = static_cast<int>(shard - processes.begin());
+
+                for (auto process : processes)
+                    if (process > 0)
+                        kill(process, SIGKILL);
+            }
+        }
+
+        if (failed >= 0)
+            throw std::runtime_error("Shard " + std::to_string(failed) + " failed.");
+
+        for (auto y = 0; y < m_quilt.height(); y++)
+            for (auto x = 0; x < m_quilt.width(); x++)
+                m_quilt[x, y] = segment.output()[static_cast<size_t>(y) * m_quilt.width() + x];
+
+        for (auto shard = 0; shard < shards; shard++) {
+            auto const& statistics = segment.statistics(shard);
+
+            m_overlap_error += statistics.overlap_error;
+            m_overlap_pixels += statistics.overlap_pixels;
+            m_seam_energy += statistics.seam_energy;
+            m_scanned += statistics.scanned;
+            m_scan_time += statistics.scan_time;
+            m_chunk_time += statistics.chunk_time;
+            m_chunk_overhead += statistics.chunk_overhead;
+            m_chunks_timed += statistics.chunks_timed;
+            m_budget_fallbacks += statistics.budget_fallbacks;
+
+#ifdef BENCHMARK
+            m_match_time += statistics.match_time;
+            m_seam_time += statistics.seam_time;
+            m_chunk_allocations += statistics.chunk_allocations;
+#endif
+        }
+    }
+
+    // Redoes the chunks of existing whose patches touch a non-zero pixel of
+    // dirty and keeps everything else. The kept pixels constrain the new
+    // patches on all sides and are blended in with seams, so only the
+    // chunks around the dirty area are searched.
+    void resynthesize(Image const& existing, Plane const& dirty, int patch_sz, int overlap_sz, int K, int flag = SYNTHESIS_CUT)
+    {
+        assert(patch_sz > overlap_sz);
+        assert(existing.width() == m_quilt.width() && existing.height() == m_quilt.height());
+        assert(dirty.width() == m_quilt.width() && dirty.height() == m_quilt.height());
+
+        auto const chunk = patch_sz - overlap_sz;
+        auto chunks = multivec<char>((m_quilt.width() + chunk - 1) / chunk, (m_quilt.height() + chunk - 1) / chunk, 0);
+
+        // A pixel lies in the patches of up to two chunks along each axis
+        auto const first_chunk = [&](int p) { return p < patch_sz ? 0 : (p - patch_sz) / chunk + 1; };
+
+        for (auto y = 0; y < m_quilt.height(); y++)
+            for (auto x = 0; x < m_quilt.width(); x++) {
+                if (!dirty[x, y])
+                    continue;
+
+                for (auto j = first_chunk(y); j <= y / chunk; j++)
+                    for (auto i = first_chunk(x); i <= x / chunk; i++)
+                        chunks[i, j] = 1;
+            }
+
+        resynthesize_chunks(existing, std::move(chunks), patch_sz, overlap_sz, K, flag);
+    }
+
+    // resynthesize() with the chunks to redo given directly, as a grid of
+    // patch_sz - overlap_sz chunks that is non-zero wherever one is dirty.
+    // Kept chunks keep every pixel, while the patches of dirty ones may cut
+    // into the overlap of a kept chunk right of or below them.
+    void resynthesize_chunks(Image const& existing, multivec<char> dirty, int patch_sz, int overlap_sz, int K, int flag = SYNTHESIS_CUT)
+    {
+        assert(patch_sz > overlap_sz);
+        assert(existing.width() == m_quilt.width() && existing.height() == m_quilt.height());
+
+        m_patch = patch_sz;
+        m_overlap = overlap_sz;
+        m_quilt = existing;
+
+        start_budget();
+        layout_chunks();
+        prepare_planes();
+
+        assert(dirty.width() == m_max_chunk_x && dirty.height() == m_max_chunk_y);
+
+        if (m_matching == MATCH_LUMINANCE)
+            m_quilt_luminance = m_quilt.luminance();
+
+        m_dirty = std::move(dirty);
+        m_queue = decltype(m_queue) {};
+
+        for (auto j = 0; j < m_max_chunk_y; j++)
+            for (auto i = 0; i < m_max_chunk_x; i++)
+                if (!m_dirty[i, j]) {
+                    m_status[i, j] = 1;
+                    m_total_completed++;
+                }
+
+        // Start from the dirty chunks that only wait on kept ones, the
+        // workers take it from there
+        for (auto j = 0; j < m_max_chunk_y; j++)
+            for (auto i = 0; i < m_max_chunk_x; i++)
+                if (is_chunk_ready({ i, j }))
+                    m_queue.push({ i, j });
+
+        run_workers(K, flag, false);
+
+        m_dirty.clear();
+    }
+
+    // Publishes a quick SYNTHESIS_RANDOM quilt first and then refines it in
+    // place with SYNTHESIS_CUT, passing publish a snapshot of the quilt about
+    // every interval and once more at the end. With a seed set the final
+    // quilt is the one synthesize() makes, since every cut patch overwrites
+    // the preview underneath it.
+    template <typename Publish>
+    void synthesize_progressive(int patch_sz, int overlap_sz, int K, Publish&& publish, std::chrono::milliseconds interval = std::chrono::milliseconds { 100 })
+    {
+        assert(patch_sz > overlap_sz);
+
+        m_patch = patch_sz;
+        m_overlap = overlap_sz;
+
+        start_budget();
+        layout_chunks();
+        prepare_planes();
+
+        run_workers(K, SYNTHESIS_RANDOM, true);
+        publish(snapshot());
+
+        layout_chunks();
+
+        m_queue = decltype(m_queue) {};
+        m_queue.push({ 0, 0 });
+
+        auto published = std::chrono::steady_clock::now();
+
+        run_workers(K, SYNTHESIS_CUT, true, [&] {
+            if (std::chrono::steady_clock::now() - published < interval)
+                return;
+
+            publish(snapshot());
+            published = std::chrono::steady_clock::now();
+        });
+
+        publish(snapshot());
+    }
+
+    // Fills checkpoint with the chunks of the running pass that are done.
+    // Called with the copy and status locks held.
+    virtual void capture_checkpoint(Checkpoint& checkpoint)
+    {
+        checkpoint.patch = m_patch;
+        checkpoint.overlap = m_overlap;
+        checkpoint.pass = m_pass;
+        checkpoint.seed = m_seed.value_or(0);
+        checkpoint.done = decltype(checkpoint.done)(m_max_chunk_x, m_max_chunk_y, 0);
+        checkpoint.offsets = decltype(checkpoint.offsets)(m_max_chunk_x, m_max_chunk_y, Coordinate {});
+
+        for (auto j = 0; j < m_max_chunk_y; j++)
+            for (auto i = 0; i < m_max_chunk_x; i++)
+                if (m_status[i, j] == 1) {
+                    checkpoint.done[i, j] = 1;
+                    checkpoint.offsets[i, j] = m_offsets[i, j];
+                }
+
+        checkpoint.quilt = m_quilt;
+    }
+
+    // Restores the checkpoint being resumed if it belongs to this pass
+    virtual bool restore_checkpoint()
+    {
+        if (!m_resume || m_resume->pass != m_pass)
+            return false;
+
+        auto const checkpoint = std::move(*m_resume);
+        m_resume.reset();
+
+        if (checkpoint.patch != m_patch || checkpoint.overlap != m_overlap
+            || checkpoint.quilt.width() != m_quilt.width() || checkpoint.quilt.height() != m_quilt.height()
+            || checkpoint.done.width() != m_max_chunk_x || checkpoint.done.height() != m_max_chunk_y)
+            throw std::runtime_error("Checkpoint does not match the synthesis being resumed.");
+
+        m_quilt = checkpoint.quilt;
+
+        if (m_matching == MATCH_LUMINANCE)
+            m_quilt_luminance = m_quilt.luminance();
+
+        for (auto j = 0; j < m_max_chunk_y; j++)
+            for (auto i = 0; i < m_max_chunk_x; i++)
+                if (checkpoint.done[i, j]) {
+                    m_status[i, j] = 1;
+                    m_offsets[i, j] = checkpoint.offsets[i, j];
+                    m_total_completed++;
+                }
+
+        m_queue = decltype(m_queue) {};
+
+        for (auto j = 0; j < m_max_chunk_y; j++)
+            for (auto i = 0; i < m_max_chunk_x; i++)
+                if (is_chunk_ready({ i, j }))
+                    m_queue.push({ i, j });
+
+        return true;
+    }
+
+    // Saves a checkpoint on a background thread if one is due
+    void checkpoint_if_due()
+    {
+        if (m_checkpoint_path.empty() || std::chrono::steady_clock::now() < m_checkpoint_due)
+            return;
+
+        if (m_checkpoint_write.valid()) {
+            if (m_checkpoint_write.wait_for(std::chrono::seconds {}) != std::future_status::ready)
+                return;
+
+            m_checkpoint_write.get();
+        }
+
+        auto checkpoint = Checkpoint {};
+
+        {
+            auto copy_lock = std::unique_lock<std::mutex>(m_copy_mtx);
+            auto status_lock = std::unique_lock<std::mutex>(m_status_mtx);
+
+            if (m_copies != m_marked)
+                return;
+
+            capture_checkpoint(checkpoint);
+        }
+
+        m_checkpoint_due = std::chrono::steady_clock::now() + m_checkpoint_interval;
+        m_checkpoint_write = std::async(std::launch::async, [checkpoint = std::move(checkpoint), path = m_checkpoint_path] {
+            checkpoint.save(path);
+        });
+    }
+
+    // Waits for the last checkpoint to be written and removes it, since the
+    // synthesis it would resume has finished
+    void finish_checkpoints()
+    {
+        if (m_checkpoint_write.valid())
+            m_checkpoint_write.get();
+
+        if (!m_checkpoint_path.empty())
+            std::filesystem::remove(m_checkpoint_path);
+    }
+
+    // Copy of the quilt that is safe to take while workers are running
+    Image snapshot()
+    {
+        auto copy_lock = std::unique_lock<std::mutex>(m_copy_mtx);
+
+        return m_quilt;
+    }
+
+    void set_seed(uint64_t seed) { m_seed = seed; }
+
+    // Saves the running pass to path about every interval, see Checkpoint.
+    // Checkpointed runs are always seeded so that resuming is deterministic.
+    void set_checkpoint(std::string const& path, std::chrono::milliseconds interval)
+    {
+        m_checkpoint_path = path;
+        m_checkpoint_interval = interval;
+        m_checkpoint_due = std::chrono::steady_clock::now() + interval;
+
+        if (!m_seed)
+            m_seed = random_seed();
+    }
+
+    // Makes the next synthesize() with the same arguments continue where the
+    // run that saved checkpoint stopped, skipping finished passes and chunks
+    void resume(Checkpoint checkpoint)
+    {
+        m_seed = checkpoint.seed;
+        m_resume = std::move(checkpoint);
+    }
+
+    // Bounds the wall time of synthesize() and friends. Chunks scan sparser
+    // as time runs short and take random patches once it is up.
+    void set_budget(std::chrono::milliseconds budget) { m_budget = budget; }
+
+    // Quality of the last pass as the mean overlap error per overlap pixel,
+    // and the chunks that ran out of time
+    double mean_overlap_error() const { return m_overlap_pixels ? m_overlap_error / static_cast<double>(m_overlap_pixels) : 0.; }
+    size_t budget_fallbacks() const { return m_budget_fallbacks; }
+
+    // Summed minimum-error boundary cost of every seam the last pass cut
+    uint64_t seam_energy() const { return m_seam_energy; }
+
+    // When the first chunk was done, if one was
+    std::optional<std::chrono::steady_clock::time_point> first_chunk() const { return m_first_chunk; }
+
+    // Candidates the last pass scored, across all chunks
+    size_t scanned_candidates() const { return m_scanned; }
+
+    // Worker time of the last pass in candidate scans, in whole chunks and
+    // in chunks besides scanning, in seconds, and the chunks it covers
+    double scan_time() const { return m_scan_time * 1e-9; }
+    double chunk_time() const { return m_chunk_time * 1e-9; }
+    double chunk_overhead() const { return m_chunk_overhead * 1e-9; }
+    size_t chunks_timed() const { return m_chunks_timed; }
+
+    // Scans every stride-th offset and searches within a stride of the best
+    // of those grid points at full density. A stride of 1 scans everything.
+    void set_subsampling(int stride, int best)
+    {
+        m_subsample_stride = std::max(stride, 1);
+        m_subsample_best = std::clamp(best, 0, Scratch::SHORTLIST);
+    }
+
+    void set_matching(int matching) { m_matching = matching; }
+
+    // Also searches rotated and mirrored views of the texture, see VIEWS_ALL
+    void set_views(int views) { m_views = views; }
+
+    // Whether the patch/overlap pair has compile-time specialized kernels
+    static bool specialized(int patch, int overlap) { return select_kernels(patch, overlap).patch != 0; }
+
+    // Worker threads per pass, 0 for as many as the CPU affinity mask and the
+    // cgroup CPU quota allow
+    void set_threads(unsigned threads) { m_worker_threads = threads; }
+
+    // Pins worker i to the i-th allowed CPU
+    void set_pinning(bool pin) { m_pin = pin; }
+
+    // Gives the workers on each NUMA node a copy of the texture and its
+    // luminance plane to scan. Workers are pinned so that they stay on the
+    // node of their copy.
+    void set_numa_replicas(bool replicate) { m_replicate = replicate; }
+
+    // Takes candidates from every exemplar of library, whose atlas must be
+    // the texture this quilt was made with
+    void set_library(ExemplarLibrary& library)
+    {
+        assert(&library.atlas() == &m_texture);
+
+        m_bands = library.bands();
+    }
+
+    void prepare_planes()
+    {
+        if (m_matching != MATCH_LUMINANCE || m_texture_luminance.size())
+            return;
+
+        m_texture_luminance = m_texture.luminance();
+        m_quilt_luminance = m_quilt.luminance();
+    }
+
+    bool is_patch_complete(Coordinate patch)
+    {
+        auto status = false;
+
+        {
+            auto lock = std::unique_lock<std::mutex>(m_status_mtx);
+            status = m_status[patch] == 1;
+        }
+
+        return status;
+    }
+
+    // A chunk can go once the chunks whose patches reach into its left and
+    // top overlaps are done: left, top and top-right. Waiting on the last
+    // one too keeps overlapping patches in a fixed order, so a seeded run
+    // does not depend on thread timing.
+    bool is_chunk_ready(Coordinate chunk)
+    {
+        if (chunk.x < 0 || chunk.x >= m_max_chunk_x || chunk.y >= m_max_chunk_y)
+            return false;
+
+        auto const complete = [this](Coordinate neighbour) {
+            return neighbour.x < 0 || neighbour.y < 0 || neighbour.x >= m_max_chunk_x || m_status[neighbour] == 1;
+        };
+
+        auto lock = std::unique_lock<std::mutex>(m_status_mtx);
+
+        return m_status[chunk] == -1
+            && complete(chunk + Coordinate { -1, 0 })
+            && complete(chunk + Coordinate { 0, -1 })
+            && complete(chunk + Coordinate { 1, -1 });
+    }
+
+    bool is_busy()
+    {
+        auto busy = false;
+
+        {
+            auto lock = std::unique_lock<std::mutex>(m_status_mtx);
+
+            busy = m_total_completed < m_status.size();
+        }
+
+        return busy;
+    }
+
+    void cleanup()
+    {
+        {
+            auto lock = std::unique_lock<std::mutex>(m_queue_mtx);
+            m_completed = true;
+        }
+
+        m_queue_convar.notify_all();
+
+        for (auto&& thread : m_pool)
+            thread.join();
+
+        m_pool.clear();
+    }
+
+    void write(std::string const& filename) const { m_quilt.write(filename); }
+
+#ifdef BENCHMARK
+    size_t chunk_allocations() const { return m_chunk_allocations; }
+
+    // Time spent by all workers in the candidate scans and seam cuts
+    double match_time() const { return m_match_time * 1e-9; }
+    double seam_time() const { return m_seam_time * 1e-9; }
+#endif
 };
@@ -0,0 +1,115 @@
+#pragma once
+
+#include <chrono>
+#include <filesystem>
+#include <future>
+#include <iostream>
+#include <memory>
+
+#include <glob.h>
+
+#include "Transfer.h"
+
+// Runs Transfer over a sequence of constraint frames. Decoding the next frame
+// and encoding the previous result overlap with the synthesis of the current
+// frame. Every frame after the first is warm-started from its predecessor,
+// and chunks whose constraint did not change are copied over unchanged.
+class Sequence {
+private:
+    Image const& m_texture;
+    std::vector<std::string> m_frames;
+
+public:
+    Sequence(Image const& texture, std::string const& frames)
+        : m_texture(texture)
+        , m_frames(expand(frames))
+    {
+    }
+
+    // A directory stands for all PNG files in it, anything else is a glob
+    static std::vector<std::string> expand(std::string const& frames)
+    {
+        auto const pattern = std::filesystem::is_directory(frames)
+            ? (std::filesystem::path(frames) / "*.png").string()
+            : frames;
+
+        auto result = glob_t {};
+
+        if (glob(pattern.c_str(), 0, NULL, &result) != 0)
+            throw std::runtime_error("No frames match '" + frames + "'.");
+
+        auto paths = std::vector<std::string>(result.gl_pathv, result.gl_pathv + result.gl_pathc);
+
+        globfree(&result);
+
+        return paths;
+    }
+
+    size_t size() const { return m_frames.size(); }
+
+    // Writes every frame to outdir under its input file name. configure is
+    // called on each frame's Transfer before it is synthesized.
+    template <typename Configure>
+    void transfer(std::string const& outdir, int patch_sz, int N, int K, Configure&& configure)
+    {
+        std::filesystem::create_directories(outdir);
+
+        auto const start = std::chrono::steady_clock::now();
+
+        auto const decode = [](std::string const& path) {
+            return std::make_shared<Image const>(path);
+        };
+
+        auto next = std::async(std::launch::async, decode, m_frames.front());
+        auto encoding = std::future<void> {};
+
+        auto previous_constraint = std::shared_ptr<Image const> {};
+        auto previous_output = std::shared_ptr<Image const> {};
+        auto previous_offsets = multivec<Coordinate> {};
+        auto previous_chunk = 0;
+
+        auto reused = size_t {};
+
+        for (auto i = 0; i < m_frames.size(); i++) {
+            auto const constraint = next.get();
+
+            if (i + 1 < m_frames.size())
+                next = std::async(std::launch::async, decode, m_frames[i + 1]);
+
+            auto transfer = Transfer(m_texture, *constraint);
+            configure(transfer);
+
+            if (previous_output)
+                transfer.set_previous_frame(*previous_constraint, *previous_output, previous_offsets, previous_chunk);
+
+            transfer.synthesize(patch_sz, N, K);
+
+            reused += transfer.reused_chunks();
+            previous_offsets = transfer.offsets();
+            previous_chunk = transfer.chunk();
+            previous_constraint = constraint;
+            previous_output = std::make_shared<Image const>(transfer.output());
+
+            if (encoding.valid())
+                encoding.get();
+
+            auto const path = (std::filesystem::path(outdir) / std::filesystem::path(m_frames[i]).filename()).string();
+
+            encoding = std::async(std::launch::async, [output = previous_output, path] {
+                output->write(path);
+            });
+
+#if DBGLN
+            std::cout << "[Sequence] Finished frame " << i + 1 << '/' << m_frames.size() << " -> " << path << '\n';
+#endif
+        }
+
+        if (encoding.valid())
+            encoding.get();
+
+        auto const elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        std::cout << "[Sequence] " << m_frames.size() << " frames in " << elapsed << "s ("
+                  << m_frames.size() / elapsed << " fps), " << reused << " chunks reused\n";
+    }
+};
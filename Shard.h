@@ -0,0 +1,125 @@
+#pragma once
+
+#include <atomic>
+#include <climits>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "Image.h"
+
+// Memory shared by the processes of a sharded synthesis. Shard k makes chunk
+// rows [first_row(k), first_row(k + 1)) and gets the overlap rows above them
+// from shard k - 1 a column at a time, behind a futex per column.
+class ShardSegment {
+public:
+    struct Statistics {
+        uint64_t overlap_error;
+        uint64_t overlap_pixels;
+        uint64_t seam_energy;
+        uint64_t scanned;
+        uint64_t scan_time;
+        uint64_t chunk_time;
+        uint64_t chunk_overhead;
+        uint64_t chunks_timed;
+        uint64_t budget_fallbacks;
+        uint64_t match_time;
+        uint64_t seam_time;
+        uint64_t chunk_allocations;
+    };
+
+private:
+    int m_shards;
+    int m_rows;
+    int m_columns;
+    int m_width;
+    int m_height;
+    int m_overlap;
+
+    void* m_memory {};
+    size_t m_size {};
+
+    Statistics* m_statistics {};
+    uint32_t* m_flags {};
+    RGBA* m_strips {};
+    RGBA* m_output {};
+
+    static long futex(uint32_t* address, int operation, uint32_t value)
+    {
+        return syscall(SYS_futex, address, operation, value, nullptr, nullptr, 0);
+    }
+
+public:
+    // Splits rows x columns chunks of a width x height output into shards
+    ShardSegment(int shards, int rows, int columns, int width, int height, int overlap)
+        : m_shards(shards)
+        , m_rows(rows)
+        , m_columns(columns)
+        , m_width(width)
+        , m_height(height)
+        , m_overlap(overlap)
+    {
+        assert(shards > 0 && shards <= rows);
+
+        auto const boundaries = static_cast<size_t>(shards - 1);
+        auto const statistics = sizeof(Statistics) * shards;
+        auto const flags = sizeof(uint32_t) * boundaries * columns;
+        auto const strips = sizeof(RGBA) * boundaries * overlap * width;
+        auto const output = sizeof(RGBA) * width * height;
+
+        m_size = statistics + flags + strips + output;
+        m_memory = mmap(nullptr, m_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+
+        if (m_memory == MAP_FAILED)
+            throw std::runtime_error("Cannot map " + std::to_string(m_size) + " bytes shared by the shards.");
+
+        // Anonymous mappings start zeroed, so every flag starts unset
+        auto* const bytes = static_cast<char*>(m_memory);
+        m_statistics = reinterpret_cast<Statistics*>(bytes);
+        m_flags = reinterpret_cast<uint32_t*>(bytes + statistics);
+        m_strips = reinterpret_cast<RGBA*>(bytes + statistics + flags);
+        m_output = reinterpret_cast<RGBA*>(bytes + statistics + flags + strips);
+    }
+
+    ShardSegment(ShardSegment const&) = delete;
+    ShardSegment& operator=(ShardSegment const&) = delete;
+
+    ~ShardSegment() { munmap(m_memory, m_size); }
+
+    int shards() const { return m_shards; }
+    int width() const { return m_width; }
+
+    // First chunk row of shard, and the row count for shard == shards()
+    int first_row(int shard) const { return static_cast<int>(static_cast<int64_t>(shard) * m_rows / m_shards); }
+
+    Statistics& statistics(int shard) { return m_statistics[shard]; }
+
+    // Overlap rows of boundary, the one above the first row of that shard,
+    // each width() pixels long
+    RGBA* strip(int boundary) { return m_strips + static_cast<size_t>(boundary - 1) * m_overlap * m_width; }
+
+    RGBA* output() { return m_output; }
+
+    // Marks the strip pixels of column done, waking any shard waiting on them
+    void publish(int boundary, int column)
+    {
+        auto* const flag = &m_flags[static_cast<size_t>(boundary - 1) * m_columns + column];
+
+        std::atomic_ref(*flag).store(1, std::memory_order_release);
+        futex(flag, FUTEX_WAKE, INT_MAX);
+    }
+
+    // Blocks until the strip pixels of column have been published
+    void wait(int boundary, int column)
+    {
+        auto* const flag = &m_flags[static_cast<size_t>(boundary - 1) * m_columns + column];
+
+        while (!std::atomic_ref(*flag).load(std::memory_order_acquire))
+            futex(flag, FUTEX_WAIT, 0);
+    }
+};
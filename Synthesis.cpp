@@ -1,16 +1,38 @@
+#include <chrono>
+#include <filesystem>
 #include <iostream>
 #include <random>
 
+#include "Library.h"
+#include "Planner.h"
 #include "Quilt.h"
+#include "Sequence.h"
 #include "Transfer.h"
+#include "Wang.h"
 
 #include <getopt.h>
 
 int main(int argc, char** argv)
 {
-    auto texture_path = std::string {};
+#ifdef BENCHMARK
+    auto const launched = std::chrono::steady_clock::now();
+#endif
+
+    auto texture_paths = std::vector<std::string> {};
     auto constraint_path = std::string {};
     auto outfile = std::string {};
+    auto existing_path = std::string {};
+    auto dirty_region = std::string {};
+    auto checkpoint_path = std::string {};
+    auto resume_path = std::string {};
+    auto checkpoint_interval = std::chrono::milliseconds { 60000 };
+    auto exemplar_memory = size_t {};
+    auto threads = 0u;
+    auto pin = false;
+    auto numa = false;
+    auto plan_target = std::optional<double> {};
+    auto shards = 1;
+    auto wang_colors = 0;
 
     auto method = Quilt::SYNTHESIS_CUT;
     auto patch_size = 0;
@@ -18,10 +40,55 @@ int main(int argc, char** argv)
     auto samples = 0;
     auto depth = 1;
 
+    auto sequence = false;
+    auto refine = 0;
+    auto memoize = false;
+    auto progressive = false;
+    auto seed = std::optional<uint64_t> {};
+    auto budget = std::optional<std::chrono::milliseconds> {};
+    auto stride = 1;
+    auto keep = 8;
+    auto matching = Quilt::MATCH_RGBA;
+    auto correspondence = Quilt::MATCH_RGBA;
+    auto views = Quilt::VIEWS_ORIGINAL;
+
     auto width = 384;
     auto height = 384;
 
-    option longopts[11] = {
+    auto const parse_filter = [](std::string const& filter) {
+        auto const filters = std::array { "none", "sub", "up", "average", "paeth", "adaptive" };
+        auto const it = std::find(filters.begin(), filters.end(), filter);
+
+        if (it == filters.end())
+            throw std::runtime_error("Unknown PNG filter '" + filter + "'.");
+
+        return static_cast<int>(it - filters.begin());
+    };
+
+    auto const parse_matching = [](std::string const& mode) {
+        if (mode == "luminance")
+            return Quilt::MATCH_LUMINANCE;
+
+        if (mode != "rgba")
+            throw std::runtime_error("Unknown matching mode '" + mode + "'.");
+
+        return Quilt::MATCH_RGBA;
+    };
+
+    auto const parse_views = [](std::string const& views) {
+        if (views == "rotations")
+            return Quilt::VIEWS_ROTATIONS;
+
+        if (views == "all")
+            return Quilt::VIEWS_ALL;
+
+        if (views != "none")
+            throw std::runtime_error("Unknown texture views '" + views + "'.");
+
+        return Quilt::VIEWS_ORIGINAL;
+    };
+
+    option longopts[] = {
         option { "texture", 1, NULL, 't' },
         option { "constraint", 1, NULL, 'c' },
         option { "outfile", 1, NULL, 'O' },
@@ -32,15 +99,40 @@ int main(int argc, char** argv)
         option { "width", 1, NULL, 'w' },
         option { "height", 1, NULL, 'h' },
         option { "depth", 1, NULL, 'd' },
+        option { "match", 1, NULL, 'M' },
+        option { "correspondence", 1, NULL, 'C' },
+        option { "refine", 1, NULL, 'r' },
+        option { "sequence", 0, NULL, 'S' },
+        option { "resynth", 1, NULL, 'R' },
+        option { "dirty", 1, NULL, 'D' },
+        option { "memo", 0, NULL, 'e' },
+        option { "seed", 1, NULL, 's' },
+        option { "progressive", 0, NULL, 'P' },
+        option { "budget", 1, NULL, 'b' },
+        option { "stride", 1, NULL, 'g' },
+        option { "keep", 1, NULL, 'k' },
+        option { "png-level", 1, NULL, 'L' },
+        option { "png-filter", 1, NULL, 'F' },
+        option { "checkpoint", 1, NULL, 'x' },
+        option { "checkpoint-interval", 1, NULL, 'X' },
+        option { "resume", 1, NULL, 'u' },
+        option { "exemplar-memory", 1, NULL, 'E' },
+        option { "threads", 1, NULL, 'j' },
+        option { "pin", 0, NULL, 'A' },
+        option { "numa", 0, NULL, 'n' },
+        option { "plan", 1, NULL, 'a' },
+        option { "shards", 1, NULL, 'N' },
+        option { "views", 1, NULL, 'v' },
+        option { "wang", 1, NULL, 'W' },
         NULL
     };
 
     auto option = '\0';
 
-    while ((option = getopt_long(argc, argv, "t:c:O:m:p:o:K:w:h:d:", longopts, 0)) != -1) {
+    while ((option = getopt_long(argc, argv, "t:c:O:m:p:o:K:w:h:d:M:C:r:SR:D:es:Pb:g:k:L:F:x:X:u:E:j:Ana:N:v:W:", longopts, 0)) != -1) {
         switch (option) {
         case 't':
-            texture_path = { optarg };
+            texture_paths.push_back(optarg);
             break;
         case 'c':
             constraint_path = { optarg };
@@ -55,7 +147,7 @@ int main(int argc, char** argv)
         case 'p':
             patch_size = atoi(optarg);
             break;
-        case 'l':
+        case 'o':
             overlap = atoi(optarg);
             break;
         case 'K':
@@ -70,14 +162,111 @@ int main(int argc, char** argv)
         case 'd':
             depth = atoi(optarg);
             break;
+        case 'M':
+            matching = parse_matching(optarg);
+            break;
+        case 'C':
+            correspondence = parse_matching(optarg);
+            break;
+        case 'r':
+            refine = atoi(optarg);
+            break;
+        case 'S':
+            sequence = true;
+            break;
+        case 'R':
+            existing_path = { optarg };
+            break;
+        case 'D':
+            dirty_region = { optarg };
+            break;
+        case 'e':
+            memoize = true;
+            break;
+        case 's':
+            seed = std::stoull(optarg);
+            break;
+        case 'P':
+            progressive = true;
+            break;
+        case 'b':
+            budget = std::chrono::milliseconds { atoi(optarg) };
+            break;
+        case 'g':
+            stride = atoi(optarg);
+            break;
+        case 'k':
+            keep = atoi(optarg);
+            break;
+        case 'L':
+            Image::png_options.level = std::clamp(atoi(optarg), 0, 9);
+            break;
+        case 'F':
+            Image::png_options.filter = parse_filter(optarg);
+            break;
+        case 'x':
+            checkpoint_path = { optarg };
+            break;
+        case 'X':
+            checkpoint_interval = std::chrono::milliseconds { static_cast<int>(atof(optarg) * 1000) };
+            break;
+        case 'u':
+            resume_path = { optarg };
+            break;
+        case 'E':
+            exemplar_memory = std::stoull(optarg) << 20;
+            break;
+        case 'j':
+            threads = std::max(atoi(optarg), 0);
+            break;
+        case 'A':
+            pin = true;
+            break;
+        case 'n':
+            numa = true;
+            break;
+        case 'a':
+            plan_target = atof(optarg);
+            break;
+        case 'N':
+            shards = std::max(atoi(optarg), 1);
+            break;
+        case 'v':
+            views = parse_views(optarg);
+            break;
+        case 'W':
+            wang_colors = std::max(atoi(optarg), 0);
+            break;
         }
     }
 
-    if (texture_path.empty())
+    if (texture_paths.empty())
         throw std::runtime_error("No texture name supplied.");
 
+    if (sequence && constraint_path.empty())
+        throw std::runtime_error("No constraint frames supplied.");
+
+    if (!existing_path.empty() && dirty_region.empty())
+        throw std::runtime_error("No dirty region supplied for re-synthesis.");
+
+    if (shards > 1 && (!constraint_path.empty() || !existing_path.empty() || progressive || !checkpoint_path.empty() || !resume_path.empty()))
+        throw std::runtime_error("Shards only run plain texture synthesis without checkpoints.");
+
+    if (wang_colors && (!constraint_path.empty() || !existing_path.empty() || progressive || shards > 1 || !checkpoint_path.empty() || !resume_path.empty()))
+        throw std::runtime_error("Wang tile sets only run plain texture synthesis without checkpoints.");
+
+    if (wang_colors && Image::is_stream(outfile))
+        throw std::runtime_error("Wang tile sets need an output file to write their metadata next to.");
+
+    if (views != Quilt::VIEWS_ORIGINAL && !constraint_path.empty())
+        throw std::runtime_error("Rotated and mirrored texture views only apply to texture synthesis without a constraint.");
+
     if (outfile.empty())
-        outfile = "output.png";
+        outfile = sequence ? "output" : "output.png";
+
+    // Keep the logs out of an image written to standard output
+    if (Image::is_stream(outfile))
+        std::cout.rdbuf(std::cerr.rdbuf());
 
     if (patch_size <= 0)
         patch_size = 18;
@@ -88,18 +277,300 @@ int main(int argc, char** argv)
     if (samples <= 0)
         samples = 3;
 
-    auto texture = Image(texture_path);
-    if (constraint_path.empty()) {
+    if (wang_colors && 2 * overlap >= patch_size)
+        throw std::runtime_error("Wang tiles need an overlap of less than half the patch size.");
+
+    // Every -t adds an exemplar, all of them are searched as one texture
+    auto library = ExemplarLibrary(texture_paths);
+    library.set_memory_limit(exemplar_memory);
+
+    // The constraint decodes while the exemplars load and the matchers get
+    // ready, unless both come from standard input, where the exemplars are
+    // first
+    auto constraint = std::optional<PendingImage> {};
+    auto const shares_stdin = Image::is_stream(constraint_path) && std::ranges::any_of(texture_paths, Image::is_stream);
+
+    auto const load_constraint = [&] {
+        if (!constraint && !constraint_path.empty() && !sequence)
+            constraint.emplace(constraint_path);
+    };
+
+    if (!shares_stdin)
+        load_constraint();
+
+#ifdef BENCHMARK
+    auto const report = [&launched](Quilt const& quilt, auto start) {
+        auto const elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start);
+
+        if (auto const first = quilt.first_chunk())
+            std::cout << "[Benchmark] first chunk: " << std::chrono::duration<double>(*first - launched).count() << "s after launch\n";
+
+        std::cout << "[Benchmark] synthesis: " << elapsed.count() << "s, "
+                  << "matching: " << quilt.match_time() << "s, "
+                  << "seams: " << quilt.seam_time() << "s, "
+                  << "chunk allocations: " << quilt.chunk_allocations() << ", "
+                  << "mean overlap error: " << quilt.mean_overlap_error() << ", "
+                  << "candidates scanned: " << quilt.scanned_candidates() << '\n';
+    };
+#endif
+
+    // Options shared by every mode
+    auto const configure = [&](Quilt& quilt) {
+        quilt.set_library(library);
+        quilt.set_matching(matching);
+        quilt.set_subsampling(stride, keep);
+        quilt.set_threads(threads);
+        quilt.set_pinning(pin);
+        quilt.set_numa_replicas(numa);
+        quilt.set_views(views);
+
+        if (seed)
+            quilt.set_seed(*seed);
+
+        if (budget)
+            quilt.set_budget(*budget);
+    };
+
+    // Lets the planner pick the matcher and subsampling that best use the
+    // target time, overriding --match, --correspondence and --stride
+    auto const plan_job = [&](Job job) -> std::optional<Plan> {
+        if (!plan_target)
+            return std::nullopt;
+
+        job.bands = library.bands();
+        job.K = samples;
+        job.threads = threads ? threads : Topology::get().workers();
+
+        auto const plan = Planner().choose(job, *plan_target, keep);
+
+        matching = plan.matching;
+        correspondence = plan.matching;
+        stride = plan.stride;
+
+        std::cout << "[Plan] " << plan.describe() << ", estimated " << plan.estimate << "s for a target of " << *plan_target << "s\n";
+
+        return plan;
+    };
+
+    auto const report_plan = [](std::optional<Plan> const& plan, auto start) {
+        if (!plan)
+            return;
+
+        auto const elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start);
+
+        std::cout << "[Plan] estimated " << plan->estimate << "s, actual " << elapsed.count() << "s\n";
+    };
+
+    // Checkpoints and resumes long syntheses. A missing resume file starts
+    // over, so a preempted job can be rerun with the same command.
+    auto const configure_checkpoints = [&](Quilt& quilt) {
+        if (!checkpoint_path.empty())
+            quilt.set_checkpoint(checkpoint_path, checkpoint_interval);
+
+        if (resume_path.empty())
+            return;
+
+        if (!std::filesystem::exists(resume_path)) {
+            std::cout << "[Checkpoint] nothing to resume at " << resume_path << ", starting over\n";
+            return;
+        }
+
+        quilt.resume(Checkpoint::load(resume_path));
+    };
+
+    // Reports how well a budgeted run did with the time it had
+    auto const report_budget = [&budget](Quilt const& quilt, auto start) {
+        if (!budget)
+            return;
+
+        auto const elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start);
+
+        std::cout << "[Budget] finished in " << elapsed.count() << "s of " << budget->count() * 1e-3 << "s, "
+                  << "mean overlap error: " << quilt.mean_overlap_error() << ", "
+                  << "chunks out of time: " << quilt.budget_fallbacks() << '\n';
+    };
+
+    // The dirty region is either x,y,w,h or a mask image that is non-black
+    // wherever the existing output should be redone
+    auto const parse_dirty = [&dirty_region](Image const& existing) {
+        auto dirty = Plane(existing.width(), existing.height(), 0);
+        auto x = 0, y = 0, w = 0, h = 0;
+
+        if (sscanf(dirty_region.c_str(), "%d,%d,%d,%d", &x, &y, &w, &h) == 4) {
+            for (auto j = std::max(y, 0); j < std::min(y + h, existing.height()); j++)
+                for (auto i = std::max(x, 0); i < std::min(x + w, existing.width()); i++)
+                    dirty[i, j] = 1;
+        } else {
+            auto const mask = Image(dirty_region);
+
+            if (mask.width() != existing.width() || mask.height() != existing.height())
+                throw std::runtime_error("Dirty mask does not match the existing output.");
+
+            for (auto j = 0; j < existing.height(); j++)
+                for (auto i = 0; i < existing.width(); i++)
+                    dirty[i, j] = Image::luminance(mask[i, j]) != 0;
+        }
+
+        return dirty;
+    };
+
+    auto const& texture = library.atlas();
+    load_constraint();
+
+    if (library.size() > 1) {
+        std::cout << "[Library] " << library.size() << " exemplars in a " << texture.width() << 'x' << texture.height()
+                  << " atlas, " << library.memory() / double(1 << 20) << " MiB\n";
+
+        for (auto i = 0; i < library.size(); i++)
+            std::cout << "[Library] " << i << ": " << library.path(i) << ", " << library.memory(i) / double(1 << 20) << " MiB\n";
+    }
+
+    if (!existing_path.empty()) {
+        // Redo the dirty part of an earlier output
+        auto const existing = Image(existing_path);
+        auto const dirty = parse_dirty(existing);
+
+        auto const start = std::chrono::steady_clock::now();
+
+        if (constraint_path.empty()) {
+            auto quilt = Quilt(texture, existing.width(), existing.height());
+            configure(quilt);
+
+            quilt.resynthesize(existing, dirty, patch_size, overlap, samples, method);
+            report_budget(quilt, start);
+
+#ifdef BENCHMARK
+            report(quilt, start);
+#endif
+
+            quilt.write(outfile);
+        } else {
+            auto transfer = Transfer(texture, constraint->get());
+            transfer.set_correspondence(correspondence);
+            configure(transfer);
+
+            transfer.resynthesize(existing, dirty, patch_size, depth, samples);
+            report_budget(transfer, start);
+
+#ifdef BENCHMARK
+            report(transfer, start);
+#endif
+
+            transfer.write(outfile);
+        }
+    } else if (sequence) {
+        // Constraint is a directory or glob of frames, outfile a directory
+        auto frames = Sequence(texture, constraint_path);
+
+        frames.transfer(outfile, patch_size, depth, samples, [&](Transfer& transfer) {
+            transfer.set_correspondence(correspondence);
+
+            // Warm starts go through the refinement search
+            transfer.set_refinement(refine ? refine : 4);
+            transfer.set_memoization(memoize);
+            configure(transfer);
+        });
+    } else if (wang_colors) {
+        // A tile set of about --width pixels per tile side
+        auto const chunk = patch_size - overlap;
+        auto tiles = WangTiles(texture, wang_colors, (width + chunk / 2) / chunk);
+
+        tiles.synthesize(patch_size, overlap, samples, configure);
+        tiles.write(outfile);
+    } else if (constraint_path.empty()) {
         // Texture synthesis if no constraint
+        auto const plan = plan_job({ .patch = patch_size, .overlap = overlap, .width = width, .height = height, .views = std::popcount(static_cast<unsigned>(views)) });
+
         auto quilt = Quilt(texture, width, height);
+        configure(quilt);
+
+        auto const start = std::chrono::steady_clock::now();
 
-        quilt.synthesize(patch_size, overlap, samples, method);
-        quilt.write(outfile);
+        if (progressive) {
+            // Replace outfile with every new preview, renaming so that
+            // viewers never see a partly written file. Standard output gets
+            // every preview as a further image in the stream.
+            auto const stream = Image::is_stream(outfile);
+            auto partial = std::filesystem::path(outfile);
+            partial.replace_extension(".partial" + partial.extension().string());
+            auto previews = 0;
+
+            quilt.synthesize_progressive(patch_size, overlap, samples, [&](Image const& preview) {
+                if (stream) {
+                    preview.write(outfile);
+                } else {
+                    preview.write(partial);
+                    std::filesystem::rename(Image::path_of(partial), Image::path_of(outfile));
+                }
+
+#ifdef BENCHMARK
+                if (!previews)
+                    std::cout << "[Benchmark] first preview: "
+                              << std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() << "s\n";
+#endif
+
+                previews++;
+            });
+
+            report_budget(quilt, start);
+            report_plan(plan, start);
+
+#ifdef BENCHMARK
+            report(quilt, start);
+#endif
+        } else {
+            configure_checkpoints(quilt);
+
+            if (shards > 1)
+                quilt.synthesize_sharded(shards, patch_size, overlap, samples, method);
+            else
+                quilt.synthesize(patch_size, overlap, samples, method);
+            report_budget(quilt, start);
+            report_plan(plan, start);
+
+#ifdef BENCHMARK
+            report(quilt, start);
+#endif
+
+            quilt.write(outfile);
+        }
     } else {
-        auto constraint = Image(constraint_path);
-        auto transfer = Transfer(texture, constraint);
+        // Only the size of the constraint is needed to start
+        auto const& size = constraint->image();
+        auto const transfer_patch = std::max(patch_size, 6);
+        auto const plan = plan_job({
+            .patch = transfer_patch,
+            .overlap = std::max(transfer_patch / 6, 3),
+            .width = size.width(),
+            .height = size.height(),
+            .passes = depth,
+            .transfer = true,
+        });
+
+        auto transfer = Transfer(texture, *constraint);
+        transfer.set_correspondence(correspondence);
+        transfer.set_refinement(refine);
+        transfer.set_memoization(memoize);
+        configure(transfer);
+        configure_checkpoints(transfer);
+
+        auto const start = std::chrono::steady_clock::now();
 
         transfer.synthesize(patch_size, depth, samples);
+        report_budget(transfer, start);
+        report_plan(plan, start);
+
+#ifdef BENCHMARK
+        report(transfer, start);
+
+        if (refine)
+            std::cout << "[Benchmark] last pass refined " << transfer.refined_chunks() << " chunks, "
+                      << transfer.refine_fallbacks() << " fell back to a full scan\n";
+
+        if (memoize)
+            std::cout << "[Benchmark] last pass memo hits: " << transfer.memo_hits() << '/' << transfer.memo_lookups() << '\n';
+#endif
+
         transfer.write(outfile);
     }
 
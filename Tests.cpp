@@ -0,0 +1,105 @@
+#include <filesystem>
+#include <iostream>
+#include <random>
+#include <string>
+
+#include "Image.h"
+#include "Quilt.h"
+
+#include <unistd.h>
+
+// Writes PNGs of heights that do not split evenly into their stripes and
+// reads them back, returning the number that did not round-trip
+static int test_png_stripes(std::string const& path)
+{
+    auto failures = 0;
+
+    for (auto height : { 1, 17, 33, 100, 321 })
+        for (auto stripes : { 1, 3, 7, 20, 64 })
+            for (auto filter : { PNGOptions::FILTER_NONE, PNGOptions::FILTER_ADAPTIVE })
+                for (auto alpha : { false, true }) {
+                    auto image = Image(37, height);
+
+                    for (auto y = 0; y < height; y++)
+                        for (auto x = 0; x < 37; x++)
+                            image[x, y] = RGBA(x * 7, y * 3, x ^ y, alpha ? 255 - y % 256 : 255);
+
+                    Image::png_options = { .filter = filter, .stripes = stripes };
+                    image.write(path, alpha);
+
+                    auto const read = Image(path);
+                    auto same = read.width() == 37 && read.height() == height;
+
+                    for (auto y = 0; same && y < height; y++)
+                        for (auto x = 0; same && x < 37; x++)
+                            same = read[x, y].value == image[x, y].value;
+
+                    if (!same) {
+                        std::cout << "[Test] PNG of 37x" << height << " in " << stripes << " stripes, filter " << filter
+                                  << (alpha ? " with" : " without") << " alpha, did not round-trip\n";
+                        failures++;
+                    }
+                }
+
+    Image::png_options = {};
+    std::filesystem::remove(path);
+
+    return failures;
+}
+
+// Synthesizes a seeded quilt with 4 threads in 2 and 3 shards and checks
+// both against the same seed on one thread, returning the number that differ
+static int test_shards()
+{
+    auto generator = std::mt19937(7);
+    auto texture = Image(64, 64);
+
+    for (auto y = 0; y < 64; y++)
+        for (auto x = 0; x < 64; x++)
+            texture[x, y] = RGBA((x * 4 + generator() % 32) & 255, (y * 4 + generator() % 32) & 255, (x + y) * 2 & 255, 255);
+
+    auto const synthesize = [&texture](unsigned threads, int shards) {
+        auto quilt = Quilt(texture, 200, 200);
+        quilt.set_seed(7);
+        quilt.set_threads(threads);
+
+        if (shards > 1)
+            quilt.synthesize_sharded(shards, 18, 3, 3);
+        else
+            quilt.synthesize(18, 3, 3);
+
+        return quilt.snapshot();
+    };
+
+    auto const expected = synthesize(1, 1);
+    auto failures = 0;
+
+    for (auto shards : { 2, 3 }) {
+        auto const quilt = synthesize(4, shards);
+        auto same = true;
+
+        for (auto y = 0; same && y < quilt.height(); y++)
+            for (auto x = 0; same && x < quilt.width(); x++)
+                same = quilt[x, y].value == expected[x, y].value;
+
+        if (!same) {
+            std::cout << "[Test] " << shards << " shards of 4 threads did not match one thread\n";
+            failures++;
+        }
+    }
+
+    return failures;
+}
+
+int main()
+{
+    auto const scratch = std::filesystem::temp_directory_path() / ("tests-" + std::to_string(getpid()));
+    auto failures = 0;
+
+    failures += test_png_stripes(scratch.string() + ".png");
+    failures += test_shards();
+
+    std::cout << "[Test] " << (failures ? std::to_string(failures) + " failures" : "all passed") << '\n';
+
+    return failures != 0;
+}
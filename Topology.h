@@ -0,0 +1,171 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <pthread.h>
+#include <sched.h>
+
+// CPUs this process may use, as limited by its affinity mask and by the CPU
+// quota of its cgroup, and the NUMA node of each, read once from procfs and
+// sysfs. Anything that cannot be read counts as unlimited, or as node 0.
+class Topology {
+private:
+    std::vector<int> m_cpus;
+    std::vector<int> m_nodes;
+    int m_node_count { 1 };
+    double m_quota {};
+
+    Topology()
+    {
+        auto set = cpu_set_t {};
+        CPU_ZERO(&set);
+
+        if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+            for (auto cpu = 0; cpu < CPU_SETSIZE; cpu++)
+                if (CPU_ISSET(cpu, &set))
+                    m_cpus.push_back(cpu);
+        }
+
+        if (m_cpus.empty())
+            for (auto cpu = 0; cpu < std::max(1u, std::thread::hardware_concurrency()); cpu++)
+                m_cpus.push_back(cpu);
+
+        m_nodes.assign(m_cpus.back() + 1, 0);
+
+        for (auto node = 0;; node++) {
+            auto file = std::ifstream("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+
+            if (!file)
+                break;
+
+            auto list = std::string {};
+            std::getline(file, list);
+
+            for (auto cpu : parse_list(list))
+                if (cpu < m_nodes.size())
+                    m_nodes[cpu] = node;
+
+            m_node_count = node + 1;
+        }
+
+        m_quota = read_quota();
+    }
+
+    // CPU list as in "0-3,8,10-11"
+    static std::vector<int> parse_list(std::string const& list)
+    {
+        auto cpus = std::vector<int> {};
+        auto stream = std::istringstream(list);
+        auto range = std::string {};
+
+        while (std::getline(stream, range, ',')) {
+            auto first = 0, last = 0;
+            auto const fields = sscanf(range.c_str(), "%d-%d", &first, &last);
+
+            if (fields < 1)
+                continue;
+
+            for (auto cpu = first; cpu <= (fields == 2 ? last : first); cpu++)
+                cpus.push_back(cpu);
+        }
+
+        return cpus;
+    }
+
+    // CPUs worth of time the cgroup may use per period, 0 if unlimited. Tries
+    // cgroup v2's cpu.max and then v1's CFS quota, walking up from the
+    // process' own cgroup since any ancestor may hold the limit.
+    static double read_quota()
+    {
+        auto proc = std::ifstream("/proc/self/cgroup");
+        auto line = std::string {};
+        auto quota = 0.;
+
+        auto const tighten = [&quota](double limit) {
+            if (limit > 0)
+                quota = quota ? std::min(quota, limit) : limit;
+        };
+
+        auto const walk = [&tighten](std::string root, std::string path, auto&& read) {
+            while (true) {
+                tighten(read(root + path));
+
+                if (path.empty() || path == "/")
+                    break;
+
+                path = path.substr(0, path.rfind('/'));
+            }
+        };
+
+        while (std::getline(proc, line)) {
+            auto const first = line.find(':');
+            auto const second = line.find(':', first + 1);
+
+            if (first == std::string::npos || second == std::string::npos)
+                continue;
+
+            auto const controllers = line.substr(first + 1, second - first - 1);
+            auto const path = line.substr(second + 1);
+
+            if (controllers.empty()) {
+                walk("/sys/fs/cgroup", path, [](std::string const& directory) {
+                    auto file = std::ifstream(directory + "/cpu.max");
+                    auto max = std::string {};
+                    auto period = 0.;
+
+                    return file >> max >> period && max != "max" && period > 0 ? std::stod(max) / period : 0.;
+                });
+            } else if (("," + controllers + ",").find(",cpu,") != std::string::npos) {
+                for (auto const* mount : { "/sys/fs/cgroup/cpu", "/sys/fs/cgroup/cpu,cpuacct" })
+                    walk(mount, path, [](std::string const& directory) {
+                        auto quota_file = std::ifstream(directory + "/cpu.cfs_quota_us");
+                        auto period_file = std::ifstream(directory + "/cpu.cfs_period_us");
+                        auto quota = 0., period = 0.;
+
+                        return quota_file >> quota && period_file >> period && quota > 0 && period > 0 ? quota / period : 0.;
+                    });
+            }
+        }
+
+        return quota;
+    }
+
+public:
+    static Topology const& get()
+    {
+        static auto const topology = Topology {};
+        return topology;
+    }
+
+    std::vector<int> const& cpus() const { return m_cpus; }
+    int node(int cpu) const { return cpu < m_nodes.size() ? m_nodes[cpu] : 0; }
+    int nodes() const { return m_node_count; }
+    double quota() const { return m_quota; }
+
+    // Threads that keep the allowed CPUs busy without exceeding the quota
+    unsigned workers() const
+    {
+        auto workers = static_cast<unsigned>(m_cpus.size());
+
+        if (m_quota > 0)
+            workers = std::min(workers, static_cast<unsigned>(std::ceil(m_quota)));
+
+        return std::max(workers, 1u);
+    }
+
+    // Restricts the calling thread to cpu
+    static void pin(int cpu)
+    {
+        auto set = cpu_set_t {};
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+
+        pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    }
+};
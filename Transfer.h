@@ -7,162 +7,620 @@ private:
     Image const& m_constraint;
     double m_alpha {};
 
+    // Compare candidates to the constraint by luminance only, as in the
+    // correspondence maps of Efros and Freeman
+    int m_correspondence { MATCH_RGBA };
+    Plane m_constraint_luminance;
+
+    // A constraint still being decoded, and how many of its rows the chunks
+    // may read, with their luminance if the correspondence needs it
+    PendingImage const* m_pending {};
+    std::atomic<int> m_constraint_rows {};
+    std::mutex m_constraint_mtx;
+
+    // Refinement passes search a window of m_refine_radius around the
+    // offsets the previous pass chose for the same area and around the
+    // continuations of the left and top neighbours, plus a few random
+    // samples, and only fall back to a full scan when the best error per
+    // pixel exceeds m_refine_tolerance times the running mean
+    int m_refine_radius {};
+    int m_refine_samples { 32 };
+    double m_refine_tolerance { 1.5 };
+
+    multivec<Coordinate> m_previous_offsets;
+    int m_previous_chunk {};
+
+    // Previous frame of a sequence. Its final offsets seed the first pass
+    // and chunks whose constraint did not change are copied from its output,
+    // keeping the offsets those pixels came from.
+    Image const* m_previous_constraint {};
+    Image const* m_previous_output {};
+    multivec<Coordinate> m_warm_offsets;
+    int m_warm_chunk {};
+    std::atomic<size_t> m_reused_chunks {};
+
+    // Correspondence errors depend only on the constraint under the patch, so
+    // chunks over repeated constraint content can share one full scan. The
+    // memo is an open-addressed table sized for one pass, with the shortlists
+    // in a flat pool, which keeps the workers allocation-free.
+    struct MemoEntry {
+        uint64_t key;
+        Coordinate source;
+        int first;
+        int size;
+    };
+
+    bool m_memoize {};
+    mutable std::vector<MemoEntry> m_memo;
+    mutable std::vector<SSD> m_memo_candidates;
+    mutable int m_memo_used {};
+    mutable std::mutex m_memo_mtx;
+    mutable std::atomic<size_t> m_memo_hits {};
+    mutable std::atomic<size_t> m_memo_lookups {};
+
+    mutable std::atomic<uint64_t> m_refine_error {};
+    mutable std::atomic<uint64_t> m_refine_pixels {};
+    mutable std::atomic<size_t> m_refine_chunks {};
+    mutable std::atomic<size_t> m_refine_fallbacks {};
+
 public:
     Transfer(Image const& texture, Image const& constraint)
         : Quilt(texture, constraint.width(), constraint.height())
         , m_constraint(constraint) {};
 
-    [[gnu::flatten, gnu::hot]] Coordinate random_overlapping_patch(Coordinate const& quxel, int K) const override
+    // Starts on the top of the constraint while the rest is still decoded,
+    // with every chunk waiting for the rows under its patch
+    Transfer(Image const& texture, PendingImage const& constraint)
+        : Transfer(texture, constraint.image())
     {
-        auto const top_overlap = quxel.y >= m_chunk;
-        auto const left_overlap = quxel.x >= m_chunk;
-        auto const corner_overlap = left_overlap && top_overlap;
+        m_pending = &constraint;
+    }
+
+    void set_correspondence(int correspondence) { m_correspondence = correspondence; }
+
+    void set_refinement(int radius) { m_refine_radius = radius; }
+
+    void set_memoization(bool memoize) { m_memoize = memoize; }
+
+    void set_previous_frame(Image const& constraint, Image const& output, multivec<Coordinate> const& offsets, int chunk)
+    {
+        assert(constraint.width() == m_constraint.width() && constraint.height() == m_constraint.height());
+
+        m_previous_constraint = &constraint;
+        m_previous_output = &output;
+        m_warm_offsets = offsets;
+        m_warm_chunk = chunk;
+    }
+
+    multivec<Coordinate> const& offsets() const { return m_offsets; }
+    int chunk() const { return m_chunk; }
+    size_t reused_chunks() const { return m_reused_chunks; }
+
+    // Waits for the first rows of a pending constraint and completes their
+    // luminance
+    void await_constraint(int rows)
+    {
+        rows = std::min(rows, m_constraint.height());
+
+        if (!m_pending || m_constraint_rows >= rows)
+            return;
+
+        m_pending->wait_rows(rows);
+
+        auto lock = std::unique_lock<std::mutex>(m_constraint_mtx);
+
+        if (m_correspondence == MATCH_LUMINANCE)
+            for (auto y = m_constraint_rows.load(); y < rows; y++)
+                for (auto x = 0; x < m_constraint.width(); x++)
+                    m_constraint_luminance[x, y] = Image::luminance(m_constraint[x, y]);
+
+        m_constraint_rows = std::max(m_constraint_rows.load(), rows);
+    }
 
-        auto const ssd_metric = [this](Coordinate const& quxel, Coordinate const& texel, Coordinate const& coord) {
-            auto const& texture = m_texture[texel + coord];
-            auto const& quilt = m_quilt[quxel + coord];
+    void await_inputs(Coordinate quxel) override { await_constraint(quxel.y + m_patch); }
 
-            return squared_difference(texture, quilt);
+    bool reuse_chunk(Coordinate chunk, Coordinate quxel) override
+    {
+        if (!m_previous_constraint)
+            return false;
+
+        auto const max = Coordinate {
+            std::min(m_quilt.width(), quxel.x + m_patch),
+            std::min(m_quilt.height(), quxel.y + m_patch)
         };
 
-        auto queue = std::priority_queue<SSD, std::vector<SSD>, std::less<SSD>> {};
+        for (auto y = quxel.y; y < max.y; y++) {
+            auto changed = false;
+            auto const row = Coordinate { quxel.x, y };
 
-        for (auto x = 0; x < m_texture.width() - m_patch; x++)
-            for (auto y = 0; y < m_texture.height() - m_patch; y++) {
-                auto patch = Coordinate { x, y };
-                auto overlap = 0;
+            for_each_span(m_constraint, row, *m_previous_constraint, row, max.x - quxel.x, [&changed](RGBA const* a, RGBA const* b, int, int n) {
+                changed = changed || memcmp(a, b, n * sizeof(RGBA));
+            });
 
-                if (left_overlap)
-                    compute_ssd<SSD_USE_ADDITION>(ssd_metric, overlap, quxel, patch, m_overlap, m_patch);
+            if (changed)
+                return false;
+        }
 
-                if (top_overlap)
-                    compute_ssd<SSD_USE_ADDITION>(ssd_metric, overlap, quxel, patch, m_patch, m_overlap);
+        // Leave the overlaps with the left and top neighbours alone, they may
+        // have been synthesized anew
+        auto const min = quxel + Coordinate { chunk.x ? m_overlap : 0, chunk.y ? m_overlap : 0 };
 
-                if (corner_overlap)
-                    compute_ssd<SSD_USE_SUBTRACTION>(ssd_metric, overlap, quxel, patch, m_overlap, m_overlap);
+        copy_region(*m_previous_output, min, max);
+
+        // Record the offset the covering chunk of the previous frame implies,
+        // which is where the copied pixels came from
+        auto const covering = Coordinate {
+            std::min<int>(quxel.x / m_warm_chunk, m_warm_offsets.width() - 1),
+            std::min<int>(quxel.y / m_warm_chunk, m_warm_offsets.height() - 1)
+        };
 
-                auto max = Coordinate {
-                    std::min(m_quilt.width(), quxel.x + m_patch),
-                    std::min(m_quilt.height(), quxel.y + m_patch)
-                } - quxel;
-                auto error = 0;
+        auto const origin = Coordinate { covering.x * m_warm_chunk, covering.y * m_warm_chunk };
 
-                compute_metric<SSD_USE_ADDITION>(
-                    [this](Coordinate const& quxel, Coordinate const& texel, Coordinate const& coord) {
-                        auto const& texture = m_texture[texel + coord];
-                        auto const& constraint = m_constraint[quxel + coord];
+        m_offsets[chunk] = m_warm_offsets[covering] + quxel - origin;
+        m_reused_chunks++;
 
-                        return squared_difference(texture, constraint);
-                    },
-                    error, quxel, patch, max.x, max.y);
+        return true;
+    }
 
-                auto ssd = static_cast<int>(m_alpha * overlap) + static_cast<int>((1. - m_alpha) * error);
+    // Full scans of the last pass and how many of them the memo answered
+    size_t memo_lookups() const { return m_memo_lookups; }
+    size_t memo_hits() const { return m_memo_hits; }
 
-                if (queue.size() < K || queue.top().ssd > ssd) {
-                    if (queue.size() == K)
-                        queue.pop();
+    // Compares the constraint under two patches of the given size, by the
+    // same plane the correspondence error reads
+    bool same_constraint(Coordinate a, Coordinate b, Coordinate size) const
+    {
+        auto same = true;
+
+        for (auto y = 0; same && y < size.y; y++) {
+            auto const first = a + Coordinate { 0, y };
+            auto const second = b + Coordinate { 0, y };
+
+            if (m_correspondence == MATCH_LUMINANCE)
+                for_each_span(m_constraint_luminance, first, m_constraint_luminance, second, size.x, [&same](u_char const* p, u_char const* q, int, int n) {
+                    same = same && !memcmp(p, q, n);
+                });
+            else
+                for_each_span(m_constraint, first, m_constraint, second, size.x, [&same](RGBA const* p, RGBA const* q, int, int n) {
+                    same = same && !memcmp(p, q, n * sizeof(RGBA));
+                });
+        }
 
-                    queue.push(SSD { ssd, patch });
-                }
+        return same;
+    }
+
+    // FNV-1a over the patch size and the constraint under the patch
+    uint64_t constraint_hash(Coordinate quxel, Coordinate size) const
+    {
+        auto hash = 14695981039346656037ull;
+
+        auto const mix = [&hash](u_char const* bytes, size_t n) {
+            for (auto i = 0; i < n; i++)
+                hash = (hash ^ bytes[i]) * 1099511628211ull;
+        };
+
+        auto const shape = std::array { m_patch, size.x, size.y };
+        mix(reinterpret_cast<u_char const*>(shape.data()), sizeof(shape));
+
+        for (auto y = 0; y < size.y; y++) {
+            auto const row = quxel + Coordinate { 0, y };
+
+            if (m_correspondence == MATCH_LUMINANCE)
+                for_each_span(m_constraint_luminance, row, m_constraint_luminance, row, size.x, [&mix](u_char const* p, u_char const*, int, int n) {
+                    mix(p, n);
+                });
+            else
+                for_each_span(m_constraint, row, m_constraint, row, size.x, [&mix](RGBA const* p, RGBA const*, int, int n) {
+                    mix(reinterpret_cast<u_char const*>(p), n * sizeof(RGBA));
+                });
+        }
+
+        return hash;
+    }
+
+    // The entry for the constraint under the patch at quxel, or the empty
+    // slot to fill if there is none. Call with m_memo_mtx held.
+    MemoEntry& memo_slot(uint64_t key, Coordinate quxel, Coordinate size) const
+    {
+        auto const mask = m_memo.size() - 1;
+
+        for (auto i = key & mask;; i = (i + 1) & mask) {
+            auto& entry = m_memo[i];
+
+            if (!entry.size || (entry.key == key && same_constraint(entry.source, quxel, size)))
+                return entry;
+        }
+    }
+
+    // Room for one entry per chunk with the table at most half full
+    void reset_memo()
+    {
+        m_memo_hits = 0;
+        m_memo_lookups = 0;
+        m_memo_used = 0;
+
+        if (!m_memoize)
+            return;
+
+        auto capacity = size_t { 1 };
+
+        while (capacity < 2 * m_status.size())
+            capacity *= 2;
+
+        m_memo.assign(capacity, MemoEntry {});
+        m_memo_candidates.resize(m_status.size() * Scratch::SHORTLIST);
+    }
+
+    // Full scan at quxel through the memo. If a chunk over the same
+    // constraint content was scanned already, only its shortlist of best
+    // correspondence errors is offered again, which leaves just the overlap
+    // term to compute. Otherwise every candidate is scanned and the shortlist
+    // is remembered.
+    template <typename Error, typename Score>
+    void memo_scan(Coordinate const& quxel, int K, Error&& correspondence_error, Score&& score, Scratch& scratch) const
+    {
+        auto const size = Coordinate {
+            std::min(m_patch, m_quilt.width() - quxel.x),
+            std::min(m_patch, m_quilt.height() - quxel.y)
+        };
+
+        auto const key = constraint_hash(quxel, size);
+        auto& shortlist = scratch.shortlist;
+        shortlist.clear();
+
+        m_memo_lookups++;
+
+        {
+            auto lock = std::unique_lock<std::mutex>(m_memo_mtx);
+            auto const& entry = memo_slot(key, quxel, size);
+
+            if (entry.size) {
+                auto const first = m_memo_candidates.cbegin() + entry.first;
+                shortlist.assign(first, first + entry.size);
             }
+        }
+
+        if (shortlist.size()) {
+            m_memo_hits++;
+
+            for (auto const& candidate : shortlist)
+                offer_candidate(scratch.candidates, K, SSD { score(candidate.coord, candidate.ssd), candidate.coord });
+
+            return;
+        }
+
+        scan_candidates(scratch, K, [&](Coordinate patch) {
+            auto const error = correspondence_error(patch);
+
+            offer_candidate(shortlist, Scratch::SHORTLIST, SSD { error, patch });
+
+            return score(patch, error);
+        });
+
+        auto lock = std::unique_lock<std::mutex>(m_memo_mtx);
+        auto& entry = memo_slot(key, quxel, size);
+
+        // Another worker may have filled the slot in the meantime
+        if (entry.size)
+            return;
+
+        entry = { key, quxel, m_memo_used, static_cast<int>(shortlist.size()) };
+        std::copy(shortlist.cbegin(), shortlist.cend(), m_memo_candidates.begin() + m_memo_used);
+        m_memo_used += Scratch::SHORTLIST;
+    }
+
+    // Chunks of the last pass that were refined locally and that needed a full scan
+    size_t refined_chunks() const { return m_refine_chunks; }
+    size_t refine_fallbacks() const { return m_refine_fallbacks; }
+
+    // Seeds the search at quxel from the previous pass. Returns false if the
+    // best local candidate is poor enough to warrant a full scan.
+    template <typename Evaluate>
+    bool refine_search(Coordinate const& quxel, Evaluate&& evaluate, std::vector<SSD>& queue) const
+    {
+        // Windows stay inside the exemplar their seed falls in
+        auto const window = [&](Coordinate seed) {
+            auto const& band = band_at(std::clamp(seed.y, 0, m_texture.height() - 1));
+            auto const max = band_candidates(band) - Coordinate { 1 };
+
+            if (max.x < 0 || max.y < 0)
+                return;
+
+            auto const clamp = [&](Coordinate coord) {
+                return Coordinate { std::clamp(coord.x, 0, max.x), std::clamp(coord.y, band.y, band.y + max.y) };
+            };
 
-        auto it = random(queue.size() - 1);
-        for (auto i = 0; i < it; i++)
-            queue.pop();
+            auto const from = clamp(seed - Coordinate { m_refine_radius });
+            auto const to = clamp(seed + Coordinate { m_refine_radius });
+
+            for (auto x = from.x; x <= to.x; x++)
+                for (auto y = from.y; y <= to.y; y++)
+                    evaluate({ x, y });
+        };
+
+        // Previous chunks whose patches cover this chunk's top-left corner region
+        auto const first = Coordinate {
+            std::min<int>(quxel.x / m_previous_chunk, m_previous_offsets.width() - 1),
+            std::min<int>(quxel.y / m_previous_chunk, m_previous_offsets.height() - 1)
+        };
+
+        auto const last = Coordinate {
+            std::min<int>((quxel.x + m_patch - 1) / m_previous_chunk, m_previous_offsets.width() - 1),
+            std::min<int>((quxel.y + m_patch - 1) / m_previous_chunk, m_previous_offsets.height() - 1)
+        };
+
+        for (auto i = first.x; i <= last.x; i++)
+            for (auto j = first.y; j <= last.y; j++) {
+                auto const origin = Coordinate { i * m_previous_chunk, j * m_previous_chunk };
+
+                window(m_previous_offsets[i, j] + quxel - origin);
+            }
+
+        // Continuing the left and top neighbours of this pass keeps the
+        // overlap term low
+        auto const chunk = Coordinate { quxel.x / m_chunk, quxel.y / m_chunk };
+
+        if (chunk.x > 0)
+            window(m_offsets[chunk.x - 1, chunk.y] + Coordinate { m_chunk, 0 });
+
+        if (chunk.y > 0)
+            window(m_offsets[chunk.x, chunk.y - 1] + Coordinate { 0, m_chunk });
+
+        for (auto i = 0; i < m_refine_samples; i++) {
+            auto const& band = random_band();
+            auto const extent = band_candidates(band);
+
+            evaluate({ random(extent.x - 1), band.y + random(extent.y - 1) });
+        }
+
+        auto const best = std::min_element(queue.cbegin(), queue.cend())->ssd;
+        auto const pixels = std::min(m_patch, m_quilt.width() - quxel.x) * std::min(m_patch, m_quilt.height() - quxel.y);
+
+        m_refine_error += best;
+        m_refine_pixels += pixels;
+
+        // Wait for a few chunks before trusting the running mean
+        auto const chunks = ++m_refine_chunks;
+        auto const mean = m_refine_error / static_cast<double>(m_refine_pixels);
+
+        if (chunks > 8 && best > m_refine_tolerance * mean * pixels) {
+            m_refine_fallbacks++;
+
+            return false;
+        }
+
+        return true;
+    }
+
+    [[gnu::flatten, gnu::hot]] Coordinate random_overlapping_patch(Coordinate const& quxel, int K, Scratch& scratch) const override
+    {
+        auto const top_overlap = quxel.y >= m_chunk;
+        auto const left_overlap = quxel.x >= m_chunk;
+        auto const right_overlap = kept_neighbour(quxel, { 1, 0 });
+        auto const bottom_overlap = kept_neighbour(quxel, { 0, 1 });
+
+        auto const overlap_error = overlap_kernel(quxel);
+        auto const& kernels = kernels_at(quxel);
+        auto const luminance = m_correspondence == MATCH_LUMINANCE;
+
+        auto& queue = scratch.candidates;
+        queue.clear();
+
+        auto const correspondence_error = [&](Coordinate patch) {
+            return luminance
+                ? (this->*kernels.luminance_patch_error)(m_constraint_luminance, quxel, patch)
+                : (this->*kernels.patch_error)(m_constraint, quxel, patch);
+        };
+
+        auto const score = [&](Coordinate patch, int error) {
+            auto overlap = (this->*overlap_error)(quxel, patch, left_overlap, top_overlap);
+
+            if (right_overlap || bottom_overlap)
+                overlap += border_error(quxel, patch, right_overlap, bottom_overlap);
+
+            return static_cast<int>(m_alpha * overlap) + static_cast<int>((1. - m_alpha) * error);
+        };
+
+        auto const full_score = [&](Coordinate patch) { return score(patch, correspondence_error(patch)); };
+        auto const evaluate = [&](Coordinate patch) { offer_candidate(queue, K, SSD { full_score(patch), patch }); };
+
+        auto const refine = m_refine_radius > 0 && m_previous_offsets.size();
+
+        if (!refine || !refine_search(quxel, evaluate, queue)) {
+            queue.clear();
+
+            if (m_memo.size())
+                memo_scan(quxel, K, correspondence_error, score, scratch);
+            else
+                scan_candidates(scratch, K, full_score);
+        }
+
+        auto const match = pick_candidate(queue);
 
 #ifdef DBGLN
-        std::cout << "Match [badness: " << queue.top().ssd << "] Texture" << queue.top().coord << " -> Quilt" << quxel << '\n';
+        std::cout << "Match [badness: " << queue.front().ssd << "] Texture" << match << " -> Quilt" << quxel << '\n';
 #endif
 
-        return queue.top().coord;
+        return match;
     }
 
-    [[gnu::flatten, gnu::cold]] Coordinate seed_patch() const
+    [[gnu::flatten, gnu::cold]] Coordinate seed_patch(int stride = 1)
     {
+        await_constraint(1);
+
         auto const& reference = m_constraint[{}];
         auto min_ssd = std::numeric_limits<uint64_t>::max();
         auto min_ssd_coord = Coordinate {};
 
-        for (auto x = 0; x < m_texture.width() - m_patch; x++)
-            for (auto y = 0; y < m_texture.height() - m_patch; y++) {
-                auto ssd = 0;
+        for (auto const& band : m_bands)
+            for (auto x = 0; x < band.width - m_patch; x += stride)
+                for (auto y = band.y; y < band.y + band.height - m_patch; y += stride) {
+                    auto ssd = 0;
 
-                for (auto u = 0; u < m_patch; u++)
-                    for (auto v = 0; v < m_patch; v++) {
-                        auto texel = Coordinate { x, y } + Coordinate { u, v };
-                        ssd += squared_difference(reference, m_texture[texel]);
-                    }
+                    for (auto u = 0; u < m_patch; u++)
+                        for (auto v = 0; v < m_patch; v++) {
+                            auto texel = Coordinate { x, y } + Coordinate { u, v };
+                            ssd += squared_difference(reference, m_texture[texel]);
+                        }
 
-                if (min_ssd > ssd) {
-                    min_ssd = ssd;
-                    min_ssd_coord = { x, y };
+                    if (min_ssd > ssd) {
+                        min_ssd = ssd;
+                        min_ssd_coord = { x, y };
+                    }
                 }
-            }
 
         return min_ssd_coord;
     }
 
     [[gnu::flatten]] void transfer(int K)
     {
-        m_chunk = m_patch - m_overlap;
+        // Keep the previous pass' choices around to seed the refinement. The
+        // first pass of a sequence frame starts from the previous frame.
+        if (m_offsets.size()) {
+            m_previous_offsets = std::move(m_offsets);
+            m_previous_chunk = m_chunk;
+        } else {
+            m_previous_offsets = m_warm_offsets;
+            m_previous_chunk = m_warm_chunk;
+        }
 
-        m_max_chunk_y = (m_quilt.height() / m_chunk) + (m_quilt.height() % m_chunk != 0);
-        m_max_chunk_x = (m_quilt.width() / m_chunk) + (m_quilt.width() % m_chunk != 0);
+        m_refine_error = 0;
+        m_refine_pixels = 0;
+        m_refine_chunks = 0;
+        m_refine_fallbacks = 0;
 
-        m_status = decltype(m_status)(m_max_chunk_x, m_max_chunk_y, -1);
-        m_completed = false;
-        m_total_completed = 0;
+        layout_chunks();
+        reset_memo();
 
         m_queue = decltype(m_queue) {}; // Clear queue
         m_queue.push({ 0, 0 });
 
-        auto const max_threads = std::thread::hardware_concurrency();
-        m_pool = decltype(m_pool) {};
+        restore_checkpoint();
+        run_workers(K, SYNTHESIS_CUT, false);
+    }
 
-        for (auto i = 0; i < max_threads; i++)
-            m_pool.push_back(std::thread([this, K] -> void {
-                return worker<SYNTHESIS_CUT>(K, false);
-            }));
+    void capture_checkpoint(Checkpoint& checkpoint) override
+    {
+        Quilt::capture_checkpoint(checkpoint);
 
-        while (is_busy()) { };
+        checkpoint.alpha = m_alpha;
+        checkpoint.previous_offsets = m_previous_offsets;
+        checkpoint.previous_chunk = m_previous_chunk;
+    }
 
-        cleanup();
+    // Also brings back the previous pass' offsets the refinement searches
+    bool restore_checkpoint() override
+    {
+        if (!m_resume || m_resume->pass != m_pass)
+            return false;
+
+        m_alpha = m_resume->alpha;
+        m_previous_offsets = m_resume->previous_offsets;
+        m_previous_chunk = m_resume->previous_chunk;
+
+        return Quilt::restore_checkpoint();
+    }
+
+    void prepare_constraint()
+    {
+        prepare_planes();
+
+        if (m_correspondence == MATCH_LUMINANCE && !m_constraint_luminance.size()) {
+            if (!m_texture_luminance.size())
+                m_texture_luminance = m_texture.luminance();
+
+            // A pending constraint gets its luminance as its rows arrive
+            m_constraint_luminance = m_pending ? Plane(m_constraint.width(), m_constraint.height(), 0) : m_constraint.luminance();
+        }
     }
 
+    // Pass schedule of synthesize(): alpha rises from .1 on the first of N
+    // passes to .9 on the last, and every pass shrinks the patch by a third
+    // until it would be 3 or less
+    static double pass_alpha(int pass, int N) { return N > 1 ? .8 * (pass / static_cast<double>(N - 1)) + .1 : .1; }
+    static int next_patch(int patch) { return static_cast<int>((2. / 3.) * patch); }
+
     [[gnu::flatten]] void synthesize(int patch_sz, int N, int K)
     {
         m_patch = std::max(patch_sz, 6);
         m_overlap = std::max(m_patch / 6, 3);
 
-        // Pick the closest match to the top-left patch in constraint from texture
-        copy_patch({}, seed_patch());
+        auto const start = std::chrono::steady_clock::now();
 
-        // Perform first pass using alpha = 0.1
-        m_alpha = 0.1;
-        transfer(K);
+        // Splits what is left of the time budget evenly over the passes left
+        auto const start_pass = [&](int pass) {
+            auto const now = std::chrono::steady_clock::now();
 
-        for (auto i = 1; i < N; i++) {
-            m_alpha = .8 * (i / static_cast<double>(N - 1)) + .1;
+            if (m_budget)
+                m_deadline = now + (start + *m_budget - now) / (N - pass);
+        };
 
-            m_patch = static_cast<int>((2. / 3.) * m_patch);
+        prepare_constraint();
 
-            if (m_patch <= 3)
-                return;
+        // Passes before the one a resumed checkpoint was taken in are done
+        auto const resumed_pass = m_resume ? m_resume->pass : 0;
+
+        // Pick the closest match to the top-left patch in constraint from
+        // texture, on a coarse grid when on a budget
+        if (!m_resume)
+            copy_patch({}, seed_patch(m_budget ? 8 : 1));
+
+        m_alpha = pass_alpha(0, N);
+        m_pass = 0;
 
+        if (!resumed_pass) {
+            start_pass(0);
+            transfer(K);
+        }
+
+        for (auto i = 1; i < N && next_patch(m_patch) > 3; i++) {
+            m_alpha = pass_alpha(i, N);
+            m_patch = next_patch(m_patch);
             m_overlap = std::max(m_patch / 6, 3);
+            m_pass = i;
 
+            if (i < resumed_pass)
+                continue;
+
+            start_pass(i);
             transfer(K);
         }
+
+        finish_checkpoints();
     }
 
-    void write(std::string const& filename)
+    // Redoes the parts of an earlier transfer whose constraint was edited, as
+    // marked by dirty. Only the last pass of synthesize(patch_sz, N, K) is
+    // repeated, with its patch size and alpha.
+    void resynthesize(Image const& existing, Plane const& dirty, int patch_sz, int N, int K)
     {
-        auto pixels = m_quilt.width() * m_quilt.height();
+        auto patch = std::max(patch_sz, 6);
+        auto pass = 0;
+
+        for (; pass + 1 < N && next_patch(patch) > 3; pass++)
+            patch = next_patch(patch);
+
+        m_alpha = pass_alpha(pass, N);
+
+        prepare_constraint();
+
+        // The memo is sized for a full pass
+        m_memo.clear();
+
+        Quilt::resynthesize(existing, dirty, patch, std::max(patch / 6, 3), K, SYNTHESIS_CUT);
+    }
+
+    // The synthesized image with the constraint's alpha channel
+    Image const& output()
+    {
+        await_constraint(m_constraint.height());
 
         for (auto x = 0; x < m_quilt.width(); x++)
             for (auto y = 0; y < m_quilt.height(); y++)
                 m_quilt[x, y].ch.a = m_constraint[x, y].ch.a;
 
-        m_quilt.write(filename);
+        return m_quilt;
     }
+
+    void write(std::string const& filename) { output().write(filename); }
 };
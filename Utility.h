@@ -1,10 +1,57 @@
 #pragma once
 
+#ifdef BENCHMARK
+// Per-thread count of heap allocations, used by the benchmark build to check
+// that the synthesis hot path stays allocation-free
+thread_local size_t g_allocations {};
+
+void* operator new(size_t size)
+{
+    g_allocations++;
+
+    if (auto* ptr = malloc(size))
+        return ptr;
+
+    throw std::bad_alloc {};
+}
+
+void operator delete(void* ptr) noexcept { free(ptr); }
+void operator delete(void* ptr, size_t) noexcept { free(ptr); }
+#endif
+
+// splitmix64 finalizer
+inline uint64_t mix_bits(uint64_t state)
+{
+    state = (state ^ (state >> 30)) * 0xbf58476d1ce4e5b9ull;
+    state = (state ^ (state >> 27)) * 0x94d049bb133111ebull;
+
+    return state ^ (state >> 31);
+}
+
+// The random device is only read here, during static initialization, and
+// every thread's generator is seeded from a counter that starts from it
 std::random_device g_rd {};
-std::mt19937 g_mtgen(g_rd());
+std::atomic<uint64_t> g_seeds { static_cast<uint64_t>(g_rd()) << 32 | g_rd() };
+
+uint64_t random_seed() { return mix_bits(g_seeds.fetch_add(0x9e3779b97f4a7c15ull)); }
+
+thread_local std::mt19937 g_mtgen(static_cast<uint32_t>(random_seed()));
 
 int random(int max) { return std::uniform_int_distribution<>(0, max)(g_mtgen); }
 
+// Restarts the calling thread's generator from a mix of the given values, so
+// that a seeded run draws the same numbers whichever thread does the work
+template <typename... Values>
+void seed_random(Values... values)
+{
+    auto state = uint64_t {};
+
+    for (auto value : { static_cast<uint64_t>(values)... })
+        state = mix_bits(state + value + 0x9e3779b97f4a7c15ull);
+
+    g_mtgen.seed(static_cast<uint32_t>(state ^ (state >> 32)));
+}
+
 class Coordinate {
 public:
     int x = 0;
@@ -54,7 +101,34 @@ public:
     }
 };
 
-template <typename T>
+// Element orders for multivec. run() is the number of elements, at most n,
+// that follow column x contiguously in memory within the same row.
+struct RowMajorLayout {
+    static constexpr bool contiguous = true;
+
+    static size_t size(size_t width, size_t height) { return width * height; }
+    static size_t index(size_t x, size_t y, size_t width) { return x + y * width; }
+    static int run(size_t, int n) { return n; }
+};
+
+// Square T x T tiles stored one after another in row-major tile order, so
+// that a patch spans far fewer cache lines and pages than in row-major order
+template <size_t T>
+struct TiledLayout {
+    static constexpr bool contiguous = false;
+
+    static size_t tiles(size_t n) { return (n + T - 1) / T; }
+    static size_t size(size_t width, size_t height) { return tiles(width) * tiles(height) * T * T; }
+
+    static size_t index(size_t x, size_t y, size_t width)
+    {
+        return ((y / T) * tiles(width) + x / T) * T * T + (y % T) * T + x % T;
+    }
+
+    static int run(size_t x, int n) { return std::min<int>(n, T - x % T); }
+};
+
+template <typename T, typename Layout = RowMajorLayout>
 class multivec {
 private:
     std::vector<T> m_vec;
@@ -68,13 +142,13 @@ public:
         : m_width(width)
         , m_height(height)
     {
-        m_vec.reserve(width * height);
+        m_vec.reserve(Layout::size(width, height));
     }
 
     multivec(auto width, auto height, T fill)
         : multivec(width, height)
     {
-        m_vec = decltype(m_vec)(width * height, fill);
+        m_vec = decltype(m_vec)(Layout::size(width, height), fill);
     }
 
     template <typename Numeric>
@@ -86,14 +160,14 @@ public:
     template <typename Numeric>
     T& operator[](Numeric i, Numeric j)
     {
-        auto idx = i + j * m_width;
+        auto idx = Layout::index(i, j, m_width);
 
         return m_vec[idx];
     }
 
     T& operator[](Coordinate coord)
     {
-        auto idx = coord.x + coord.y * m_width;
+        auto idx = Layout::index(coord.x, coord.y, m_width);
 
         return m_vec[idx];
     }
@@ -107,27 +181,30 @@ public:
     template <typename Numeric>
     T const& operator[](Numeric i, Numeric j) const
     {
-        auto idx = i + j * m_width;
+        auto idx = Layout::index(i, j, m_width);
 
         return m_vec[idx];
     }
 
     T const& operator[](Coordinate coord) const
     {
-        auto idx = coord.x + coord.y * m_width;
+        auto idx = Layout::index(coord.x, coord.y, m_width);
 
         return m_vec[idx];
     }
 
+    int run(int x, int n) const { return Layout::run(x, n); }
+
     size_t size() const { return m_vec.size(); }
+    size_t width() const { return m_width; }
+    size_t height() const { return m_height; }
 
     void clear() { m_vec.clear(); }
 
     void fill(T value)
     {
-        clear();
-
-        m_vec = decltype(m_vec)(m_width * m_height, value);
+        // assign() reuses the existing capacity, so refilling is allocation-free
+        m_vec.assign(Layout::size(m_width, m_height), value);
     }
 };
 
@@ -224,3 +301,113 @@ union RGBA {
         return stream;
     }
 };
+
+// Eight 32-bit lanes. GCC lowers these to whatever vector width the target
+// supports, falling back to pairs of SSE registers without AVX.
+typedef uint32_t u32x8 __attribute__((vector_size(32)));
+typedef int32_t i32x8 __attribute__((vector_size(32)));
+typedef uint8_t u8x8 __attribute__((vector_size(8)));
+
+// Unaligned vector loads and stores. Vectors go in and out by reference:
+// passing 32-byte vectors by value ties a function's ABI to whether AVX is
+// enabled, which GCC warns about.
+template <typename V, typename T>
+[[gnu::always_inline]] inline void load(V& value, T const* ptr)
+{
+    memcpy(&value, ptr, sizeof(V));
+}
+
+template <typename V, typename T>
+[[gnu::always_inline]] inline void store(T* ptr, V const& value)
+{
+    memcpy(ptr, &value, sizeof(V));
+}
+
+// Vector counterpart of squared_difference(RGBA, RGBA) on the eight pixels at
+// first and second, added to out
+[[gnu::always_inline]] inline void add_squared_differences(RGBA const* first, RGBA const* second, u32x8& out)
+{
+    auto a = u32x8 {}, b = u32x8 {};
+    load(a, first);
+    load(b, second);
+
+    auto const diff = (i32x8)((a & 0xFF) + ((a >> 8) & 0xFF) + ((a >> 16) & 0xFF))
+        - (i32x8)((b & 0xFF) + ((b >> 8) & 0xFF) + ((b >> 16) & 0xFF));
+
+    out += (u32x8)(diff * diff);
+}
+
+// Per-pixel squared_difference of two RGBA rows of length n
+[[gnu::hot]] inline void squared_difference(RGBA const* first, RGBA const* second, int n, uint32_t* out)
+{
+    auto i = 0;
+
+    for (; i + 8 <= n; i += 8) {
+        auto squares = u32x8 {};
+        add_squared_differences(first + i, second + i, squares);
+        store(out + i, squares);
+    }
+
+    for (; i < n; i++)
+        out[i] = squared_difference(first[i], second[i]);
+}
+
+// Sum of squared_difference over a row of n pixels. A non-zero N fixes the
+// length at compile time so the loop can be fully unrolled.
+template <int N = 0>
+[[gnu::always_inline]] inline uint32_t row_error(RGBA const* first, RGBA const* second, int n = N)
+{
+    if constexpr (N > 0)
+        n = N;
+
+    auto acc = u32x8 {};
+    auto i = 0;
+
+    for (; i + 8 <= n; i += 8)
+        add_squared_differences(first + i, second + i, acc);
+
+    auto sum = 0u;
+
+    for (auto k = 0; k < 8; k++)
+        sum += acc[k];
+
+    for (; i < n; i++)
+        sum += squared_difference(first[i], second[i]);
+
+    return sum;
+}
+
+// Luminance counterpart of row_error. Squared luma differences are scaled by
+// 9 so they are comparable to squared_difference over the summed channels.
+template <int N = 0>
+[[gnu::always_inline]] inline uint32_t row_error(u_char const* first, u_char const* second, int n = N)
+{
+    if constexpr (N > 0)
+        n = N;
+
+    auto acc = i32x8 {};
+    auto i = 0;
+
+    for (; i + 8 <= n; i += 8) {
+        auto a = u8x8 {}, b = u8x8 {};
+        load(a, first + i);
+        load(b, second + i);
+
+        auto const diff = __builtin_convertvector(a, i32x8) - __builtin_convertvector(b, i32x8);
+
+        acc += diff * diff;
+    }
+
+    auto sum = 0u;
+
+    for (auto k = 0; k < 8; k++)
+        sum += acc[k];
+
+    for (; i < n; i++) {
+        auto const diff = first[i] - second[i];
+        sum += diff * diff;
+    }
+
+    return 9 * sum;
+}
+
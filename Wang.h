@@ -0,0 +1,236 @@
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+
+#include "Quilt.h"
+
+// A complete set of Wang tiles over a number of edge colors: one tile for
+// every color of its north, east, south and west edges, so that tiles laid
+// next to each other join without a seam wherever the edges they share
+// have the same color.
+//
+// Every tile side is a whole number of chunks. The ring of chunks around a
+// tile comes from an edge strip per orientation and color, which runs
+// across the edge so that the tiles on either side take its two halves.
+// The corners of every tile come from one corner block that begins and
+// ends every strip, so they agree whatever the colors. Only the interiors
+// are synthesized per tile, cutting their seams into the ring.
+//
+// The strips of each orientation are stacked into one image with the
+// corner block between them and resynthesized together, and all tile
+// interiors in one atlas, so the whole set takes four runs on the worker
+// pool over the same texture.
+class WangTiles {
+private:
+    Image const& m_texture;
+    int m_colors;
+    int m_chunks;
+
+    int m_patch {};
+    int m_overlap {};
+    int m_chunk {};
+    int m_size {};
+
+    // The corner block and the strips are band pixels across: a chunk on
+    // either side of the edge or corner and the overlap that the chunks
+    // after it compare against
+    int m_band {};
+
+    Image m_corner;
+    Image m_vertical;
+    Image m_horizontal;
+    Image m_atlas;
+
+public:
+    // Tiles of chunks x chunks chunks, at least 3 so that every tile has an
+    // interior
+    WangTiles(Image const& texture, int colors, int chunks)
+        : m_texture(texture)
+        , m_colors(colors)
+        , m_chunks(std::max(chunks, 3))
+    {
+        assert(colors > 0);
+    }
+
+    int colors() const { return m_colors; }
+    int tiles() const { return m_colors * m_colors * m_colors * m_colors; }
+
+    // Tiles per atlas row, and per column
+    int columns() const { return m_colors * m_colors; }
+
+    // Side of a tile in pixels, once synthesized
+    int size() const { return m_size; }
+
+    // Edge colors of tile as north, east, south and west
+    std::array<int, 4> edges(int tile) const
+    {
+        return { tile / (m_colors * m_colors * m_colors), tile / (m_colors * m_colors) % m_colors, tile / m_colors % m_colors, tile % m_colors };
+    }
+
+    Coordinate origin(int tile) const { return { tile % columns() * m_size, tile / columns() * m_size }; }
+
+    Image const& atlas() const { return m_atlas; }
+
+    // Synthesizes the whole set. configure is called on each Quilt before
+    // it runs.
+    template <typename Configure>
+    void synthesize(int patch_sz, int overlap_sz, int K, Configure&& configure)
+    {
+        assert(patch_sz > 2 * overlap_sz);
+
+        m_patch = patch_sz;
+        m_overlap = overlap_sz;
+        m_chunk = m_patch - m_overlap;
+        m_size = m_chunks * m_chunk;
+        m_band = 2 * m_chunk + m_overlap;
+
+        auto const start = std::chrono::steady_clock::now();
+
+        {
+            auto quilt = Quilt(m_texture, m_band, m_band);
+            configure(quilt);
+
+            quilt.synthesize(m_patch, m_overlap, K);
+            m_corner = quilt.snapshot();
+        }
+
+        auto const cornered = std::chrono::steady_clock::now();
+
+        m_vertical = synthesize_strips(true, K, configure);
+        m_horizontal = synthesize_strips(false, K, configure);
+
+        auto const stripped = std::chrono::steady_clock::now();
+
+        auto const side = columns() * m_size;
+        auto atlas = Image(side, side);
+        auto dirty = multivec<char>(columns() * m_chunks, columns() * m_chunks, 0);
+
+        for (auto tile = 0; tile < tiles(); tile++) {
+            place_ring(atlas, tile);
+
+            auto const first = Coordinate { tile % columns() * m_chunks, tile / columns() * m_chunks };
+
+            for (auto j = 1; j + 1 < m_chunks; j++)
+                for (auto i = 1; i + 1 < m_chunks; i++)
+                    dirty[first + Coordinate { i, j }] = 1;
+        }
+
+        {
+            auto quilt = Quilt(m_texture, side, side);
+            configure(quilt);
+
+            quilt.resynthesize_chunks(atlas, std::move(dirty), m_patch, m_overlap, K);
+            m_atlas = quilt.snapshot();
+        }
+
+        auto const seconds = [](auto from, auto to) { return std::chrono::duration<double>(to - from).count(); };
+
+        std::cout << "[Wang] " << tiles() << " tiles of " << m_size << "px over " << m_colors << " colors in "
+                  << seconds(start, std::chrono::steady_clock::now()) << "s (corner " << seconds(start, cornered)
+                  << "s, strips " << seconds(cornered, stripped) << "s, tiles " << seconds(stripped, std::chrono::steady_clock::now()) << "s)\n";
+    }
+
+    // Writes the atlas to outfile and the position and edge colors of every
+    // tile in it as JSON next to it
+    void write(std::string const& outfile) const
+    {
+        m_atlas.write(outfile);
+
+        auto path = std::filesystem::path(Image::path_of(outfile));
+        path.replace_extension(".json");
+
+        auto file = std::ofstream(path);
+
+        file << "{\n"
+             << "  \"image\": \"" << std::filesystem::path(Image::path_of(outfile)).filename().string() << "\",\n"
+             << "  \"tile_size\": " << m_size << ",\n"
+             << "  \"colors\": " << m_colors << ",\n"
+             << "  \"columns\": " << columns() << ",\n"
+             << "  \"rows\": " << columns() << ",\n"
+             << "  \"tiles\": [\n";
+
+        for (auto tile = 0; tile < tiles(); tile++) {
+            auto const [north, east, south, west] = edges(tile);
+            auto const position = origin(tile);
+
+            file << "    { \"x\": " << position.x << ", \"y\": " << position.y << ", \"north\": " << north << ", \"east\": " << east
+                 << ", \"south\": " << south << ", \"west\": " << west << " }" << (tile + 1 < tiles() ? "," : "") << '\n';
+        }
+
+        file << "  ]\n}\n";
+
+        if (!file)
+            throw std::runtime_error("Cannot write tile metadata '" + path.string() + "'.");
+    }
+
+private:
+    // Synthesizes the strip of every color for the vertical or the
+    // horizontal edges, one after another along the edge, with the corner
+    // block centred on every tile corner between them. The chunks of the
+    // block are kept and the rest of each strip redone, so the strips are
+    // independent of each other and start in parallel.
+    template <typename Configure>
+    Image synthesize_strips(bool vertical, int K, Configure&& configure) const
+    {
+        auto const length = m_colors * m_size;
+        auto strips = vertical ? Image(m_band, length) : Image(length, m_band);
+
+        // Pixel at a position along and across the edges
+        auto const at = [vertical](auto& image, int along, int across) -> auto& {
+            return vertical ? image[across, along] : image[along, across];
+        };
+
+        for (auto corner = 0; corner <= m_colors; corner++)
+            for (auto along = std::max(corner * m_size - m_chunk, 0); along < std::min(corner * m_size + m_chunk + m_overlap, length); along++)
+                for (auto across = 0; across < m_band; across++)
+                    at(strips, along, across) = at(m_corner, along - corner * m_size + m_chunk, across);
+
+        auto const across_chunks = (m_band + m_chunk - 1) / m_chunk;
+        auto const along_chunks = m_colors * m_chunks;
+        auto dirty = vertical ? multivec<char>(across_chunks, along_chunks, 0) : multivec<char>(along_chunks, across_chunks, 0);
+
+        for (auto along = 0; along < along_chunks; along++)
+            for (auto across = 0; across < across_chunks; across++)
+                if (along % m_chunks && along % m_chunks + 1 < m_chunks)
+                    dirty[vertical ? Coordinate { across, along } : Coordinate { along, across }] = 1;
+
+        auto quilt = Quilt(m_texture, strips.width(), strips.height());
+        configure(quilt);
+
+        quilt.resynthesize_chunks(strips, std::move(dirty), m_patch, m_overlap, K);
+
+        return quilt.snapshot();
+    }
+
+    // Copies the ring of chunks around tile into atlas from its strips,
+    // with the overlap inside the ring that its interior compares against.
+    // The chunks of the vertical strips also cut into the corner block below
+    // them, so the sides keep those rows of the corner chunks under them.
+    void place_ring(Image& atlas, int tile) const
+    {
+        auto const [north, east, south, west] = edges(tile);
+        auto const origin = this->origin(tile);
+
+        auto const copy = [&](Image const& strip, Coordinate from, Coordinate to, Coordinate extent) {
+            for (auto y = 0; y < extent.y; y++)
+                for (auto x = 0; x < extent.x; x++)
+                    atlas[origin + to + Coordinate { x, y }] = strip[from + Coordinate { x, y }];
+        };
+
+        // North and south halves of the horizontal strips, each edge on row
+        // m_chunk of its strip
+        copy(m_horizontal, { north * m_size, m_chunk }, { 0, 0 }, { m_size, m_chunk + m_overlap });
+        copy(m_horizontal, { south * m_size, 0 }, { 0, m_size - m_chunk }, { m_size, m_chunk });
+
+        // West and east halves of the vertical strips between the corners
+        auto const side = m_size - 2 * m_chunk;
+
+        copy(m_vertical, { m_chunk, west * m_size + m_chunk }, { 0, m_chunk }, { m_chunk + m_overlap, side });
+        copy(m_vertical, { m_chunk, west * m_size + m_size - m_chunk }, { 0, m_size - m_chunk }, { m_chunk, m_overlap });
+        copy(m_vertical, { 0, east * m_size + m_chunk }, { m_size - m_chunk, m_chunk }, { m_chunk, side + m_overlap });
+    }
+};